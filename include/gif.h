@@ -24,6 +24,8 @@
 // Create a GifWriter struct. Pass it to GifBegin() to initialize and write the header.
 // Pass subsequent frames to GifWriteFrame().
 // Finally, call GifEnd() to close the file handle and free memory.
+// To write somewhere other than a file, use GifBeginSink() with a GifWriteFunc callback, or
+// with none to collect the whole GIF in memory.
 //
 
 #ifndef gif_h
@@ -37,8 +39,9 @@
 // Define these macros to hook into a custom memory allocator.
 // TEMP_MALLOC and TEMP_FREE will only be called in stack fashion - frees in the reverse order of mallocs
 // and any temp memory allocated by a function will be freed before it exits.
-// MALLOC and FREE are used only by GifBegin and GifEnd respectively (to allocate a buffer the size of the image, which
-// is used to find changed pixels for delta-encoding.)
+// MALLOC and FREE are used for the memory a GifWriter or GifEncoder keeps between frames (images held for
+// delta-encoding and the encoder's scratch space), which is released by GifEnd or GifFreeEncoder.
+// REALLOC grows the buffers that output is assembled in (see GifBuffer) and FREE releases them.
 
 #ifndef GIF_TEMP_MALLOC
 #include <stdlib.h>
@@ -60,18 +63,17 @@
 #define GIF_FREE free
 #endif
 
+#ifndef GIF_REALLOC
+#include <stdlib.h>
+#define GIF_REALLOC realloc
+#endif
+
 const int kGifTransIndex = 0;
 
-static uint8_t kGifTransRed = 0;
-static uint8_t kGifTransGreen = 0;
-static uint8_t kGifTransBlue = 0;
-
-void GifSetTransparentColor(uint8_t r, uint8_t g, uint8_t b)
-{
-    kGifTransRed = r;
-    kGifTransGreen = g;
-    kGifTransBlue = b;
-}
+// Disposal methods written to each frame's graphics control extension: what a viewer does
+// with the frame's rectangle before drawing the next frame.
+const int kGifDisposeNone = 1;        // leave it on the canvas; the next frame may be a delta
+const int kGifDisposeBackground = 2;  // clear it to transparent
 
 typedef struct
 {
@@ -145,6 +147,99 @@ void GifGetClosestPaletteColor( GifPalette* pPal, int r, int g, int b, int* best
     }
 }
 
+// Open-addressing hash from packed RGB to palette index, filled as a frame is palettized.
+// Sprite frames use only a handful of distinct colors, so after the first few pixels nearly
+// every lookup is answered here instead of by walking the k-d tree.
+#define GIF_COLOR_CACHE_SIZE 4096 // must be a power of two
+
+typedef struct
+{
+    uint32_t keys[GIF_COLOR_CACHE_SIZE];    // packed RGB + 1, 0 marks an empty slot
+    uint8_t indices[GIF_COLOR_CACHE_SIZE];
+    uint32_t count;
+} GifColorCache;
+
+void GifClearColorCache( GifColorCache* cache )
+{
+    memset(cache->keys, 0, sizeof(cache->keys));
+    cache->count = 0;
+}
+
+// Settings and scratch memory for encoding frames. There is no global state: every GifWriter
+// owns one (writer->encoder), and threads that encode frames themselves with GifEncodeFrame()
+// each need their own. The scratch buffers are allocated by the first frame that needs them
+// and reused by every frame after it.
+typedef struct
+{
+    uint8_t transRed;      // color of palette entry 0, the transparency index
+    uint8_t transGreen;
+    uint8_t transBlue;
+    uint8_t padding[5];    // make padding explicit
+
+    struct GifLzwTable* lzwTable;
+    GifColorCache* cache;
+    uint8_t* image;        // palettized frame, followed by copies of its sub-rectangle
+    size_t imageSize;
+} GifEncoder;
+
+void GifInitEncoder( GifEncoder* encoder )
+{
+    memset(encoder, 0, sizeof(GifEncoder));
+}
+
+// For a GifWriter, set writer->encoder's color after GifBegin and before the first frame.
+// Palettes built before the change keep the color they were built with.
+void GifSetTransparentColor( GifEncoder* encoder, uint8_t r, uint8_t g, uint8_t b )
+{
+    encoder->transRed = r;
+    encoder->transGreen = g;
+    encoder->transBlue = b;
+}
+
+void GifFreeEncoder( GifEncoder* encoder )
+{
+    GIF_FREE(encoder->lzwTable);
+    GIF_FREE(encoder->cache);
+    GIF_FREE(encoder->image);
+    encoder->lzwTable = NULL;
+    encoder->cache = NULL;
+    encoder->image = NULL;
+    encoder->imageSize = 0;
+}
+
+// Finds the slot holding a color, or the empty slot where it would be inserted.
+bool GifFindCachedColor( const GifColorCache* cache, int r, int g, int b, uint32_t* key, uint32_t* slot )
+{
+    *key = (((uint32_t)r << 16) | ((uint32_t)g << 8) | (uint32_t)b) + 1;
+    *slot = (*key * 2654435761u) & (GIF_COLOR_CACHE_SIZE-1);
+    while( cache->keys[*slot] )
+    {
+        if( cache->keys[*slot] == *key ) return true;
+        *slot = (*slot+1) & (GIF_COLOR_CACHE_SIZE-1);
+    }
+    return false;
+}
+
+// Returns the palette index for a color, consulting the cache before the k-d tree.
+int GifLookupPaletteColor( GifColorCache* cache, GifPalette* pPal, int r, int g, int b )
+{
+    uint32_t key, slot;
+    if( GifFindCachedColor(cache, r, g, b, &key, &slot) ) return cache->indices[slot];
+
+    int32_t bestDiff = 1000000;
+    int32_t bestInd = 1;
+    GifGetClosestPaletteColor(pPal, r, g, b, &bestInd, &bestDiff, 1);
+
+    // stop inserting once the table is 3/4 full so probe chains stay short
+    if( cache->count < GIF_COLOR_CACHE_SIZE/4*3 )
+    {
+        cache->keys[slot] = key;
+        cache->indices[slot] = (uint8_t)bestInd;
+        ++cache->count;
+    }
+    return bestInd;
+}
+
 void GifSwapPixels(uint8_t* image, int pixA, int pixB)
 {
     uint8_t rA = image[pixA*4];
@@ -362,7 +457,8 @@ void GifSplitPalette(uint8_t* image, int numPixels, int treeNode, int treeLevel,
 // Finds all pixels that have changed from the previous image and
 // moves them to the fromt of th buffer.
 // This allows us to build a palette optimized for the colors of the
-// changed pixels only.
+// changed pixels only. A pixel that turns from transparent to opaque
+// counts as changed even if its color channels are the same.
 int GifPickChangedPixels( const uint8_t* lastFrame, uint8_t* frame, int numPixels )
 {
     int numChanged = 0;
@@ -372,11 +468,13 @@ int GifPickChangedPixels( const uint8_t* lastFrame, uint8_t* frame, int numPixel
     {
         if(lastFrame[0] != frame[0] ||
            lastFrame[1] != frame[1] ||
-           lastFrame[2] != frame[2])
+           lastFrame[2] != frame[2] ||
+           (lastFrame[3] == 0) != (frame[3] == 0))
         {
             writeIter[0] = frame[0];
             writeIter[1] = frame[1];
             writeIter[2] = frame[2];
+            writeIter[3] = frame[3];
             ++numChanged;
             writeIter += 4;
         }
@@ -389,7 +487,7 @@ int GifPickChangedPixels( const uint8_t* lastFrame, uint8_t* frame, int numPixel
 
 // Creates a palette by placing all the image pixels in a k-d tree and then averaging the blocks at the bottom.
 // This is known as the "median split" technique
-void GifMakePalette( const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_t width, uint32_t height, int bitDepth, bool buildForDither, GifPalette* pPal )
+void GifMakePalette( const GifEncoder* encoder, const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_t width, uint32_t height, int bitDepth, bool buildForDither, GifPalette* pPal )
 {
     pPal->bitDepth = bitDepth;
     memset(pPal->r, 0, sizeof(pPal->r));
@@ -433,9 +531,53 @@ void GifMakePalette( const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_
     pPal->treeSplit[1 << (bitDepth-1)] = 0;
     pPal->treeSplitElt[1 << (bitDepth-1)] = 0;
 
-    pPal->r[0] = kGifTransRed;
-    pPal->g[0] = kGifTransGreen;
-    pPal->b[0] = kGifTransBlue;
+    pPal->r[0] = encoder->transRed;
+    pPal->g[0] = encoder->transGreen;
+    pPal->b[0] = encoder->transBlue;
+}
+
+// Builds a palette holding exactly the colors of the pixels that need palettizing (opaque, and
+// changed from lastFrame if one is given) and records each color's index in the cache, so
+// GifThresholdImage never has to search. Uses the smallest bit depth that fits.
+// Returns false if there are more colors than 2^bitDepth-1 (index 0 is the transparency color);
+// the caller then falls back to GifMakePalette.
+bool GifMakeExactPalette( const GifEncoder* encoder, const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_t width, uint32_t height, int bitDepth, GifPalette* pPal, GifColorCache* cache )
+{
+    memset(pPal, 0, sizeof(GifPalette));
+    GifClearColorCache(cache);
+
+    const int maxColors = (1 << bitDepth) - 1;
+    int numColors = 0;
+
+    uint32_t numPixels = width*height;
+    for( uint32_t ii=0; ii<numPixels; ++ii, nextFrame += 4 )
+    {
+        const uint8_t* lastPix = lastFrame? lastFrame + ii*4 : NULL;
+        if(nextFrame[3] == 0) continue;
+        if(lastPix && lastPix[3] != 0 && lastPix[0] == nextFrame[0] && lastPix[1] == nextFrame[1] && lastPix[2] == nextFrame[2]) continue;
+
+        uint32_t key, slot;
+        if( GifFindCachedColor(cache, nextFrame[0], nextFrame[1], nextFrame[2], &key, &slot) ) continue;
+        if( numColors == maxColors ) return false;
+
+        ++numColors;
+        pPal->r[numColors] = nextFrame[0];
+        pPal->g[numColors] = nextFrame[1];
+        pPal->b[numColors] = nextFrame[2];
+        cache->keys[slot] = key;
+        cache->indices[slot] = (uint8_t)numColors;
+        ++cache->count;
+    }
+
+    // GIF's minimum LZW code size is 2 bits
+    int depth = 2;
+    while( (1 << depth) < numColors+1 ) ++depth;
+    pPal->bitDepth = depth;
+
+    pPal->r[0] = encoder->transRed;
+    pPal->g[0] = encoder->transGreen;
+    pPal->b[0] = encoder->transBlue;
+    return true;
 }
 
 // Implements Floyd-Steinberg dithering, writes palette value to alpha
@@ -470,9 +612,9 @@ void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t
 
             if (aa == 0)
             {
-                nextPix[0] = kGifTransRed;
-                nextPix[1] = kGifTransGreen;
-                nextPix[2] = kGifTransBlue;
+                nextPix[0] = pPal->r[kGifTransIndex];
+                nextPix[1] = pPal->g[kGifTransIndex];
+                nextPix[2] = pPal->b[kGifTransIndex];
                 nextPix[3] = kGifTransIndex;
                 continue;
             }
@@ -480,6 +622,7 @@ void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t
             // if it happens that we want the color from last frame, then just write out
             // a transparent pixel
             if( lastFrame &&
+               lastPix[3] != 0 &&
                lastPix[0] == rr &&
                lastPix[1] == gg &&
                lastPix[2] == bb )
@@ -557,8 +700,90 @@ void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t
     GIF_TEMP_FREE(quantPixels);
 }
 
-// Picks palette colors for the image using simple thresholding, no dithering
-void GifThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal )
+// A palette shared by every frame of a GIF. It is written once as the global color table
+// (see GifBeginWithPalette) and frames encoded against it carry no local table.
+typedef struct
+{
+    GifPalette pal;
+    GifColorCache cache;   // colors already mapped to pal; each frame starts from a copy
+    bool exact;            // pal holds every color exactly, so there is nothing to dither
+    bool indexed;          // frames arrive already palettized: each pixel's alpha is its index
+    uint8_t padding[6];    // make padding explicit
+} GifGlobalPalette;
+
+// Builds an exact global palette one frame at a time, so the frames never have to be held
+// together: GifBeginExactPalette, then GifAddExactColors for each frame's pixels (transparent
+// pixels are ignored), then GifEndExactPalette. GifAddExactColors returns false once the
+// frames use more than 2^bitDepth-1 colors; the palette is then unusable.
+void GifBeginExactPalette( GifGlobalPalette* global )
+{
+    memset(&global->pal, 0, sizeof(GifPalette));
+    GifClearColorCache(&global->cache);
+}
+
+bool GifAddExactColors( const uint8_t* pixels, uint32_t numPixels, int bitDepth, GifGlobalPalette* global )
+{
+    // every color gets its own cache slot, so the cache also counts the palette entries
+    GifColorCache* cache = &global->cache;
+    const uint32_t maxColors = (1u << bitDepth) - 1;
+    for( uint32_t ii=0; ii<numPixels; ++ii, pixels += 4 )
+    {
+        if(pixels[3] == 0) continue;
+
+        uint32_t key, slot;
+        if( GifFindCachedColor(cache, pixels[0], pixels[1], pixels[2], &key, &slot) ) continue;
+        if( cache->count == maxColors ) return false;
+
+        ++cache->count;
+        global->pal.r[cache->count] = pixels[0];
+        global->pal.g[cache->count] = pixels[1];
+        global->pal.b[cache->count] = pixels[2];
+        cache->keys[slot] = key;
+        cache->indices[slot] = (uint8_t)cache->count;
+    }
+    return true;
+}
+
+void GifEndExactPalette( const GifEncoder* encoder, GifGlobalPalette* global )
+{
+    // GIF's minimum LZW code size is 2 bits
+    int depth = 2;
+    while( (1u << depth) < global->cache.count+1 ) ++depth;
+    global->pal.bitDepth = depth;
+
+    global->pal.r[0] = encoder->transRed;
+    global->pal.g[0] = encoder->transGreen;
+    global->pal.b[0] = encoder->transBlue;
+    global->exact = true;
+    global->indexed = false;
+}
+
+// Builds a global palette from the pixels of every frame packed back to back (transparent
+// pixels are ignored): an exact palette if they use at most 2^bitDepth-1 colors, otherwise
+// a median split over all of them. The cache is warmed with every color seen, so frames
+// rarely have to search the tree.
+void GifMakeGlobalPalette( const GifEncoder* encoder, const uint8_t* pixels, uint32_t numPixels, int bitDepth, bool buildForDither, GifGlobalPalette* global )
+{
+    GifBeginExactPalette(global);
+    if( GifAddExactColors(pixels, numPixels, bitDepth, global) )
+    {
+        GifEndExactPalette(encoder, global);
+        return;
+    }
+    global->exact = false;
+    global->indexed = false;
+
+    GifMakePalette(encoder, NULL, pixels, numPixels, 1, bitDepth, buildForDither, &global->pal);
+    GifClearColorCache(&global->cache);
+    for( uint32_t ii=0; ii<numPixels; ++ii, pixels += 4 )
+    {
+        if(pixels[3] != 0) GifLookupPaletteColor(&global->cache, &global->pal, pixels[0], pixels[1], pixels[2]);
+    }
+}
+
+// Picks palette colors for the image using simple thresholding, no dithering.
+// The cache must be empty or filled for this palette (see GifMakeExactPalette).
+void GifThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal, GifColorCache* cache )
 {
     uint32_t numPixels = width*height;
     for( uint32_t ii=0; ii<numPixels; ++ii )
@@ -567,12 +792,13 @@ void GifThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint
         // set the pixel to transparent
         if(nextFrame[3] == 0)
         {
-            outFrame[0] = kGifTransRed;
-            outFrame[1] = kGifTransGreen;
-            outFrame[2] = kGifTransBlue;
+            outFrame[0] = pPal->r[kGifTransIndex];
+            outFrame[1] = pPal->g[kGifTransIndex];
+            outFrame[2] = pPal->b[kGifTransIndex];
             outFrame[3] = kGifTransIndex;
         }
         else if(lastFrame &&
+           lastFrame[3] != 0 &&
            lastFrame[0] == nextFrame[0] &&
            lastFrame[1] == nextFrame[1] &&
            lastFrame[2] == nextFrame[2])
@@ -585,9 +811,7 @@ void GifThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint
         else
         {
             // palettize the pixel
-            int32_t bestDiff = 1000000;
-            int32_t bestInd = 1;
-            GifGetClosestPaletteColor(pPal, nextFrame[0], nextFrame[1], nextFrame[2], &bestInd, &bestDiff, 1);
+            int32_t bestInd = GifLookupPaletteColor(cache, pPal, nextFrame[0], nextFrame[1], nextFrame[2]);
 
             // Write the resulting color to the output buffer
             outFrame[0] = pPal->r[bestInd];
@@ -602,137 +826,279 @@ void GifThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint
     }
 }
 
-// Simple structure to write out the LZW-compressed portion of the image
-// one bit at a time
+// For frames already palettized against an indexed GifGlobalPalette: keeps the index each
+// opaque pixel carries in its alpha, and like GifThresholdImage writes pixels unchanged
+// from lastFrame (and transparent ones) as the transparency index.
+void GifCopyIndexedImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, const GifPalette* pPal )
+{
+    uint32_t numPixels = width*height;
+    for( uint32_t ii=0; ii<numPixels; ++ii )
+    {
+        memcpy(outFrame, nextFrame, 4);
+        if(nextFrame[3] == 0)
+        {
+            outFrame[0] = pPal->r[kGifTransIndex];
+            outFrame[1] = pPal->g[kGifTransIndex];
+            outFrame[2] = pPal->b[kGifTransIndex];
+        }
+        else if(lastFrame &&
+           lastFrame[3] != 0 &&
+           lastFrame[0] == nextFrame[0] &&
+           lastFrame[1] == nextFrame[1] &&
+           lastFrame[2] == nextFrame[2])
+        {
+            outFrame[3] = kGifTransIndex;
+        }
+
+        if(lastFrame) lastFrame += 4;
+        outFrame += 4;
+        nextFrame += 4;
+    }
+}
+
+// Receives finished GIF bytes, e.g. whole frames; returns false if they could not be written.
+typedef bool (*GifWriteFunc)( void* context, const uint8_t* data, size_t size );
+
+// Growable byte buffer that all output is assembled in. With a write function it is a sink:
+// GifFlushBuffer() hands everything gathered so far to it in a single call and empties the
+// buffer. Without one the bytes just accumulate in memory.
 typedef struct
 {
-    uint32_t chunkIndex;
-    uint8_t chunk[256];   // bytes are written in here until we have 256 of them, then written to the file
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+    GifWriteFunc write;
+    void* context;
+    bool failed;           // an allocation or write failed; later output is dropped
+    uint8_t padding[7];    // make padding explicit
+} GifBuffer;
 
-    uint8_t bitIndex;  // how many bits in the partial byte written so far
-    uint8_t byte;      // current partial byte
+void GifInitBuffer( GifBuffer* buf, GifWriteFunc write, void* context )
+{
+    buf->data = NULL;
+    buf->size = 0;
+    buf->capacity = 0;
+    buf->write = write;
+    buf->context = context;
+    buf->failed = false;
+}
 
-    uint8_t padding[2];    // make padding explicit
-} GifBitStatus;
+void GifFreeBuffer( GifBuffer* buf )
+{
+    GIF_FREE(buf->data);
+    buf->data = NULL;
+    buf->size = 0;
+    buf->capacity = 0;
+}
 
-// insert a single bit
-void GifWriteBit( GifBitStatus* stat, uint32_t bit )
+bool GifReserveBuffer( GifBuffer* buf, size_t extra )
 {
-    bit = bit & 1;
-    bit = bit << stat->bitIndex;
-    stat->byte |= bit;
+    if( buf->failed ) return false;
+    if( buf->capacity - buf->size >= extra ) return true;
 
-    ++stat->bitIndex;
-    if( stat->bitIndex > 7 )
+    size_t capacity = buf->capacity? buf->capacity : 4096;
+    while( capacity - buf->size < extra ) capacity *= 2;
+    uint8_t* data = (uint8_t*)GIF_REALLOC(buf->data, capacity);
+    if( !data )
     {
-        // move the newly-finished byte to the chunk buffer
-        stat->chunk[stat->chunkIndex++] = stat->byte;
-        // and start a new byte
-        stat->bitIndex = 0;
-        stat->byte = 0;
+        buf->failed = true;
+        return false;
     }
+    buf->data = data;
+    buf->capacity = capacity;
+    return true;
 }
 
-// write all bytes so far to the file
-void GifWriteChunk( FILE* f, GifBitStatus* stat )
+void GifPutByte( GifBuffer* buf, int byte )
 {
-    fputc((int)stat->chunkIndex, f);
-    fwrite(stat->chunk, 1, stat->chunkIndex, f);
+    if( buf->size == buf->capacity && !GifReserveBuffer(buf, 1) ) return;
+    buf->data[buf->size++] = (uint8_t)byte;
+}
 
-    stat->bitIndex = 0;
-    stat->byte = 0;
-    stat->chunkIndex = 0;
+void GifPutBytes( GifBuffer* buf, const void* data, size_t size )
+{
+    if( !GifReserveBuffer(buf, size) ) return;
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
 }
 
-void GifWriteCode( FILE* f, GifBitStatus* stat, uint32_t code, uint32_t length )
+bool GifFlushBuffer( GifBuffer* buf )
 {
-    for( uint32_t ii=0; ii<length; ++ii )
+    if( buf->write && buf->size && !buf->failed )
     {
-        GifWriteBit(stat, code);
-        code = code >> 1;
-
-        if( stat->chunkIndex == 255 )
-        {
-            GifWriteChunk(f, stat);
-        }
+        if( !buf->write(buf->context, buf->data, buf->size) ) buf->failed = true;
+        buf->size = 0;
     }
+    return !buf->failed;
+}
+
+// GifWriteFunc for a stdio stream. GifBegin turns off the stream's own buffering, so each
+// flush is a single write.
+bool GifWriteToFile( void* context, const uint8_t* data, size_t size )
+{
+    return fwrite(data, 1, size, (FILE*)context) == size;
 }
 
-// The LZW dictionary is a 256-ary tree constructed as the file is encoded,
-// this is one node
+// Packs the LZW codes of an image, least significant bit first. Codes are appended to a
+// 64-bit accumulator with a single shift, and whole bytes leave it four at a time for the
+// sub-block buffer.
 typedef struct
 {
-    uint16_t m_next[256];
-} GifLzwNode;
+    uint64_t bits;         // pending bits, oldest in the low end
+    uint32_t bitCount;     // how many bits are pending (< 32 between codes)
+    uint32_t chunkIndex;   // bytes in chunk; every 255 of them are written out as a sub-block
+    uint8_t chunk[264];    // room for a full sub-block plus one more 4-byte store
+} GifBitStatus;
 
-// write a 256-color (8-bit) image palette to the file
-void GifWritePalette( const GifPalette* pPal, FILE* f )
+// write one full sub-block to the file, keeping any bytes past it for the next one
+void GifWriteChunk( GifBuffer* out, GifBitStatus* stat )
 {
-    fputc(kGifTransRed, f);  // first color: transparency
-    fputc(kGifTransGreen, f);
-    fputc(kGifTransBlue, f);
+    GifPutByte(out, 255);
+    GifPutBytes(out, stat->chunk, 255);
+
+    stat->chunkIndex -= 255;
+    memmove(stat->chunk, stat->chunk + 255, stat->chunkIndex);
+}
 
-    for(int ii=1; ii<(1 << pPal->bitDepth); ++ii)
+void GifWriteCode( GifBuffer* out, GifBitStatus* stat, uint32_t code, uint32_t length )
+{
+    stat->bits |= (uint64_t)code << stat->bitCount;
+    stat->bitCount += length;
+    if( stat->bitCount < 32 ) return;
+
+    uint8_t* bytes = stat->chunk + stat->chunkIndex;
+    bytes[0] = (uint8_t)stat->bits;
+    bytes[1] = (uint8_t)(stat->bits >> 8);
+    bytes[2] = (uint8_t)(stat->bits >> 16);
+    bytes[3] = (uint8_t)(stat->bits >> 24);
+    stat->chunkIndex += 4;
+    stat->bits >>= 32;
+    stat->bitCount -= 32;
+
+    if( stat->chunkIndex >= 255 ) GifWriteChunk(out, stat);
+}
+
+// write out the pending bits, zero-padded to a whole byte, and the last partial sub-block
+void GifFlushCodes( GifBuffer* out, GifBitStatus* stat )
+{
+    while( stat->bitCount > 0 )
     {
-        uint32_t r = pPal->r[ii];
-        uint32_t g = pPal->g[ii];
-        uint32_t b = pPal->b[ii];
+        stat->chunk[stat->chunkIndex++] = (uint8_t)stat->bits;
+        stat->bits >>= 8;
+        stat->bitCount = stat->bitCount > 8? stat->bitCount - 8 : 0;
+        if( stat->chunkIndex == 255 ) GifWriteChunk(out, stat);
+    }
 
-        fputc((int)r, f);
-        fputc((int)g, f);
-        fputc((int)b, f);
+    if( stat->chunkIndex )
+    {
+        GifPutByte(out, (int)stat->chunkIndex);
+        GifPutBytes(out, stat->chunk, stat->chunkIndex);
+        stat->chunkIndex = 0;
     }
 }
 
-// write the image header, LZW-compress and write out the image
-void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uint32_t width, uint32_t height, uint32_t delay, GifPalette* pPal)
+// The LZW dictionary, constructed as the file is encoded: an open-addressing hash from
+// (prefix code, next index) to the code of that string. At ~30KB it stays in cache and is
+// cheap to clear, unlike a 256-way child table per code.
+#define GIF_LZW_HASH_SIZE 5003 // prime, and at most ~77% full when the dictionary is
+
+typedef struct GifLzwTable
 {
-    // graphics control extension
-    fputc(0x21, f);
-    fputc(0xf9, f);
-    fputc(0x04, f);
-    fputc(0x09, f); // restore to background before rendering, this frame has transparency
-    fputc(delay & 0xff, f);
-    fputc((delay >> 8) & 0xff, f);
-    fputc(kGifTransIndex, f); // transparent color index
-    fputc(0, f);
+    uint32_t keys[GIF_LZW_HASH_SIZE];    // (prefix << 8 | index) + 1, 0 marks an empty slot
+    uint16_t codes[GIF_LZW_HASH_SIZE];
+} GifLzwTable;
 
-    fputc(0x2c, f); // image descriptor block
+void GifClearLzwTable( GifLzwTable* table )
+{
+    memset(table->keys, 0, sizeof(table->keys));
+}
 
-    fputc(left & 0xff, f);           // corner of image in canvas space
-    fputc((left >> 8) & 0xff, f);
-    fputc(top & 0xff, f);
-    fputc((top >> 8) & 0xff, f);
+// Finds the slot holding a string, or the empty slot where it would be inserted.
+// Probes by double hashing, as in compress(1).
+uint32_t GifFindLzwSlot( const GifLzwTable* table, uint32_t prefix, uint8_t value, uint32_t key )
+{
+    int32_t slot = (int32_t)(((uint32_t)value << 4) ^ prefix);
+    const int32_t step = slot? GIF_LZW_HASH_SIZE - slot : 1;
+    while( table->keys[slot] && table->keys[slot] != key )
+    {
+        slot -= step;
+        if( slot < 0 ) slot += GIF_LZW_HASH_SIZE;
+    }
+    return (uint32_t)slot;
+}
 
-    fputc(width & 0xff, f);          // width and height of image
-    fputc((width >> 8) & 0xff, f);
-    fputc(height & 0xff, f);
-    fputc((height >> 8) & 0xff, f);
+// write a 256-color (8-bit) image palette to the file
+void GifWritePalette( const GifPalette* pPal, GifBuffer* out )
+{
+    const int numColors = 1 << pPal->bitDepth;
+    if( !GifReserveBuffer(out, (size_t)numColors*3) ) return;
 
-    //fputc(0, f); // no local color table, no transparency
-    //fputc(0x80, f); // no local color table, but transparency
+    uint8_t* rgb = out->data + out->size;
+    for(int ii=0; ii<numColors; ++ii)  // first color: transparency
+    {
+        rgb[ii*3+0] = pPal->r[ii];
+        rgb[ii*3+1] = pPal->g[ii];
+        rgb[ii*3+2] = pPal->b[ii];
+    }
+    out->size += (size_t)numColors*3;
+}
 
-    fputc(0x80 + pPal->bitDepth-1, f); // local color table present, 2 ^ bitDepth entries
-    GifWritePalette(pPal, f);
+// write the image header, LZW-compress and write out the image
+// Without a local palette the image indexes the global color table, which must match pPal.
+// codetable is scratch space for the dictionary.
+void GifWriteLzwImage(GifBuffer* out, GifLzwTable* codetable, uint8_t* image, uint32_t left, uint32_t top,  uint32_t width, uint32_t height, uint32_t delay, int disposal, GifPalette* pPal, bool localPalette)
+{
+    // graphics control extension
+    GifPutByte(out, 0x21);
+    GifPutByte(out, 0xf9);
+    GifPutByte(out, 0x04);
+    GifPutByte(out, (disposal << 2) | 0x01); // disposal method, this frame has transparency
+    GifPutByte(out, delay & 0xff);
+    GifPutByte(out, (delay >> 8) & 0xff);
+    GifPutByte(out, kGifTransIndex); // transparent color index
+    GifPutByte(out, 0);
+
+    GifPutByte(out, 0x2c); // image descriptor block
+
+    GifPutByte(out, left & 0xff);           // corner of image in canvas space
+    GifPutByte(out, (left >> 8) & 0xff);
+    GifPutByte(out, top & 0xff);
+    GifPutByte(out, (top >> 8) & 0xff);
+
+    GifPutByte(out, width & 0xff);          // width and height of image
+    GifPutByte(out, (width >> 8) & 0xff);
+    GifPutByte(out, height & 0xff);
+    GifPutByte(out, (height >> 8) & 0xff);
+
+    //GifPutByte(out, 0); // no local color table, no transparency
+    //GifPutByte(out, 0x80); // no local color table, but transparency
+
+    if(localPalette)
+    {
+        GifPutByte(out, 0x80 + pPal->bitDepth-1); // local color table present, 2 ^ bitDepth entries
+        GifWritePalette(pPal, out);
+    }
+    else
+    {
+        GifPutByte(out, 0); // no local color table, use the global one
+    }
 
     const int minCodeSize = pPal->bitDepth;
     const uint32_t clearCode = 1 << pPal->bitDepth;
 
-    fputc(minCodeSize, f); // min code size 8 bits
+    GifPutByte(out, minCodeSize); // min code size 8 bits
 
-    GifLzwNode* codetree = (GifLzwNode*)GIF_TEMP_MALLOC(sizeof(GifLzwNode)*4096);
-
-    memset(codetree, 0, sizeof(GifLzwNode)*4096);
+    GifClearLzwTable(codetable);
     int32_t curCode = -1;
     uint32_t codeSize = (uint32_t)minCodeSize + 1;
     uint32_t maxCode = clearCode+1;
 
     GifBitStatus stat;
-    stat.byte = 0;
-    stat.bitIndex = 0;
+    stat.bits = 0;
+    stat.bitCount = 0;
     stat.chunkIndex = 0;
 
-    GifWriteCode(f, &stat, clearCode, codeSize);  // start with a fresh LZW dictionary
+    GifWriteCode(out, &stat, clearCode, codeSize);  // start with a fresh LZW dictionary
 
     for(uint32_t yy=0; yy<height; ++yy)
     {
@@ -754,19 +1120,24 @@ void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uin
             {
                 // first value in a new run
                 curCode = nextValue;
+                continue;
             }
-            else if( codetree[curCode].m_next[nextValue] )
+
+            const uint32_t key = (((uint32_t)curCode << 8) | nextValue) + 1;
+            const uint32_t slot = GifFindLzwSlot(codetable, (uint32_t)curCode, nextValue, key);
+            if( codetable->keys[slot] )
             {
                 // current run already in the dictionary
-                curCode = codetree[curCode].m_next[nextValue];
+                curCode = codetable->codes[slot];
             }
             else
             {
                 // finish the current run, write a code
-                GifWriteCode(f, &stat, (uint32_t)curCode, codeSize);
+                GifWriteCode(out, &stat, (uint32_t)curCode, codeSize);
 
                 // insert the new run into the dictionary
-                codetree[curCode].m_next[nextValue] = (uint16_t)++maxCode;
+                codetable->keys[slot] = key;
+                codetable->codes[slot] = (uint16_t)++maxCode;
 
                 if( maxCode >= (1ul << codeSize) )
                 {
@@ -777,9 +1148,9 @@ void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uin
                 if( maxCode == 4095 )
                 {
                     // the dictionary is full, clear it out and begin anew
-                    GifWriteCode(f, &stat, clearCode, codeSize); // clear tree
+                    GifWriteCode(out, &stat, clearCode, codeSize); // clear tree
 
-                    memset(codetree, 0, sizeof(GifLzwNode)*4096);
+                    GifClearLzwTable(codetable);
                     codeSize = (uint32_t)(minCodeSize + 1);
                     maxCode = clearCode+1;
                 }
@@ -790,127 +1161,463 @@ void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uin
     }
 
     // compression footer
-    GifWriteCode(f, &stat, (uint32_t)curCode, codeSize);
-    GifWriteCode(f, &stat, clearCode, codeSize);
-    GifWriteCode(f, &stat, clearCode + 1, (uint32_t)minCodeSize + 1);
+    GifWriteCode(out, &stat, (uint32_t)curCode, codeSize);
+    // the decoder adds a dictionary entry for that code too, which may widen the clear code
+    if( ++maxCode >= (1ul << codeSize) ) codeSize++;
+    GifWriteCode(out, &stat, clearCode, codeSize);
+    GifWriteCode(out, &stat, clearCode + 1, (uint32_t)minCodeSize + 1);
 
     // write out the last partial chunk
-    while( stat.bitIndex ) GifWriteBit(&stat, 0);
-    if( stat.chunkIndex ) GifWriteChunk(f, &stat);
-
-    fputc(0, f); // image block terminator
+    GifFlushCodes(out, &stat);
 
-    GIF_TEMP_FREE(codetree);
+    GifPutByte(out, 0); // image block terminator
 }
 
 typedef struct
 {
-    FILE* f;
-    uint8_t* oldImage;
+    FILE* f;               // the file opened by GifBegin, NULL when writing to a caller's sink
+    GifBuffer out;         // everything is assembled here and flushed to the sink once per frame
+    GifEncoder encoder;    // transparency color and scratch memory for every frame
+    const GifGlobalPalette* globalPalette;   // NULL unless created with a global palette
+    uint32_t width;        // for the header, which is written with the first frame
+    uint32_t height;
+    uint32_t delay;
+    bool isOpen;
     bool firstFrame;
 
-    uint8_t padding[7];    // make padding explicit
+    // Delta encoding (see GifSetDeltaEncoding). Whether a frame may stay on the canvas
+    // depends on the frame after it, so each frame is written one call late.
+    bool deltaEncode;
+    bool hasPending;
+    bool lastKept;         // the last written frame was left on the canvas
+
+    uint8_t padding[3];    // make padding explicit
+
+    uint8_t* firstImage;   // needed to decide how the last frame loops back to the first
+    uint8_t* lastImage;
+    uint8_t* pendingImage;
+    uint32_t pendingWidth;
+    uint32_t pendingHeight;
+    uint32_t pendingDelay;
+    int pendingBitDepth;
+    bool pendingDither;
+
+    uint8_t padding2[7];   // make padding explicit
 } GifWriter;
 
+// Writes the file header and global color table. It is held back until the first frame so
+// the transparency color can still be set on writer->encoder after GifBegin.
+void GifWriteHeader( GifWriter* writer )
+{
+    GifBuffer* out = &writer->out;
+    const uint32_t width = writer->width;
+    const uint32_t height = writer->height;
+    GifPutBytes(out, "GIF89a", 6);
+
+    // screen descriptor
+    GifPutByte(out, width & 0xff);
+    GifPutByte(out, (width >> 8) & 0xff);
+    GifPutByte(out, height & 0xff);
+    GifPutByte(out, (height >> 8) & 0xff);
+
+    if(writer->globalPalette)
+    {
+        GifPutByte(out, 0xf0 + writer->globalPalette->pal.bitDepth-1);  // unsorted global color table, 2 ^ bitDepth entries
+        GifPutByte(out, 0);     // background color
+        GifPutByte(out, 0);     // pixels are square
+
+        GifWritePalette(&writer->globalPalette->pal, out);
+    }
+    else
+    {
+        GifPutByte(out, 0xf0);  // there is an unsorted global color table of 2 entries
+        GifPutByte(out, 0);     // background color
+        GifPutByte(out, 0);     // pixels are square (we need to specify this because it's 1989)
+
+        // now the "global" palette (really just a dummy palette)
+        // color 0: transparency color
+        GifPutByte(out, writer->encoder.transRed);
+        GifPutByte(out, writer->encoder.transGreen);
+        GifPutByte(out, writer->encoder.transBlue);
+        // color 1: also black
+        GifPutByte(out, 0);
+        GifPutByte(out, 0);
+        GifPutByte(out, 0);
+    }
+
+    if( writer->delay != 0 )
+    {
+        // animation header
+        GifPutByte(out, 0x21); // extension
+        GifPutByte(out, 0xff); // application specific
+        GifPutByte(out, 11); // length 11
+        GifPutBytes(out, "NETSCAPE2.0", 11); // yes, really
+        GifPutByte(out, 3); // 3 bytes of NETSCAPE2.0 data
+
+        GifPutByte(out, 1); // this is the Netscape 2.0 sub-block ID and it must be 1, otherwise some viewers error
+        GifPutByte(out, 0); // loop infinitely (byte 0)
+        GifPutByte(out, 0); // loop infinitely (byte 1)
+
+        GifPutByte(out, 0); // block terminator
+    }
+}
+
+// Starts a GIF that is handed to write() (with context) a frame at a time. With a NULL write
+// function the whole GIF collects in writer->out instead; after GifEnd() its data and size
+// hold the file, and the caller releases it with GifFreeBuffer().
+// If globalPalette is given it is written as the global color table and every frame is
+// encoded against it instead of getting its own palette. The palette must outlive the writer.
+// The input GIFWriter is assumed to be uninitialized. Nothing is written until the first frame.
+bool GifBeginSink( GifWriter* writer, GifWriteFunc write, void* context, uint32_t width, uint32_t height, uint32_t delay, const GifGlobalPalette* globalPalette )
+{
+    writer->f = NULL;
+    GifInitBuffer(&writer->out, write, context);
+    writer->globalPalette = globalPalette;
+    writer->firstFrame = true;
+    writer->deltaEncode = false;
+    writer->hasPending = false;
+    writer->lastKept = false;
+    writer->firstImage = NULL;
+    writer->lastImage = NULL;
+    writer->pendingImage = NULL;
+
+    writer->width = width;
+    writer->height = height;
+    writer->delay = delay;
+    GifInitEncoder(&writer->encoder);
+    writer->isOpen = true;
+    return true;
+}
+
+// Like GifBegin, with a global palette (see GifBeginSink).
+bool GifBeginWithPalette( GifWriter* writer, const char* filename, uint32_t width, uint32_t height, uint32_t delay, const GifGlobalPalette* globalPalette )
+{
+    FILE* f;
+#if defined(_MSC_VER) && (_MSC_VER >= 1400)
+	f = 0;
+    fopen_s(&f, filename, "wb");
+#else
+    f = fopen(filename, "wb");
+#endif
+    if(!f)
+    {
+        writer->isOpen = false;
+        return false;
+    }
+
+    // output is already gathered a frame at a time, so stdio's buffer would only add a copy
+    setvbuf(f, NULL, _IONBF, 0);
+
+    if(!GifBeginSink(writer, GifWriteToFile, f, width, height, delay, globalPalette))
+    {
+        fclose(f);
+        return false;
+    }
+    writer->f = f;
+    return true;
+}
+
 // Creates a gif file.
 // The input GIFWriter is assumed to be uninitialized.
 // The delay value is the time between frames in hundredths of a second - note that not all viewers pay much attention to this value.
 bool GifBegin( GifWriter* writer, const char* filename, uint32_t width, uint32_t height, uint32_t delay, int32_t bitDepth, bool dither )
 {
     (void)bitDepth; (void)dither; // Mute "Unused argument" warnings
-#if defined(_MSC_VER) && (_MSC_VER >= 1400)
-	writer->f = 0;
-    fopen_s(&writer->f, filename, "wb");
-#else
-    writer->f = fopen(filename, "wb");
-#endif
-    if(!writer->f) return false;
+    return GifBeginWithPalette(writer, filename, width, height, delay, NULL);
+}
 
-    writer->firstFrame = true;
+// Returns true if any pixel that is opaque in curFrame is transparent in nextFrame.
+// Drawing nextFrame over curFrame can't express that, so curFrame must then be disposed
+// to the background (and nextFrame drawn in full) instead of being left on the canvas.
+bool GifNeedsClear( const uint8_t* curFrame, const uint8_t* nextFrame, uint32_t numPixels )
+{
+    for( uint32_t ii=0; ii<numPixels; ++ii )
+    {
+        if(curFrame[ii*4+3] != 0 && nextFrame[ii*4+3] == 0)
+            return true;
+    }
+    return false;
+}
 
-    // allocate
-    writer->oldImage = (uint8_t*)GIF_MALLOC(width*height*4);
+// Finds the smallest rectangle holding every pixel a frame has to draw: its opaque pixels, or,
+// given the frame left on the canvas, just the opaque pixels that differ from it.
+// Returns false (leaving the outputs untouched) if there are none.
+bool GifFindFrameBounds( const uint8_t* prevImage, const uint8_t* image, uint32_t width, uint32_t height, uint32_t* left, uint32_t* top, uint32_t* subWidth, uint32_t* subHeight )
+{
+    uint32_t minX = width, minY = height, maxX = 0, maxY = 0;
+    for( uint32_t yy=0; yy<height; ++yy )
+    {
+        const uint8_t* pix = image + (size_t)yy*width*4;
+        const uint8_t* prev = prevImage? prevImage + (size_t)yy*width*4 : NULL;
+        for( uint32_t xx=0; xx<width; ++xx, pix += 4 )
+        {
+            bool draws = pix[3] != 0;
+            if(draws && prev)
+            {
+                draws = prev[3] == 0 || prev[0] != pix[0] || prev[1] != pix[1] || prev[2] != pix[2];
+            }
+            if(prev) prev += 4;
+            if(!draws) continue;
 
-    fputs("GIF89a", writer->f);
+            if(xx < minX) minX = xx;
+            if(xx > maxX) maxX = xx;
+            if(yy < minY) minY = yy;
+            maxY = yy;
+        }
+    }
 
-    // screen descriptor
-    fputc(width & 0xff, writer->f);
-    fputc((width >> 8) & 0xff, writer->f);
-    fputc(height & 0xff, writer->f);
-    fputc((height >> 8) & 0xff, writer->f);
-
-    fputc(0xf0, writer->f);  // there is an unsorted global color table of 2 entries
-    fputc(0, writer->f);     // background color
-    fputc(0, writer->f);     // pixels are square (we need to specify this because it's 1989)
-
-    // now the "global" palette (really just a dummy palette)
-    // color 0: transparency color
-    fputc(kGifTransRed, writer->f);
-    fputc(kGifTransGreen, writer->f);
-    fputc(kGifTransBlue, writer->f);
-    // color 1: also black
-    fputc(0, writer->f);
-    fputc(0, writer->f);
-    fputc(0, writer->f);
-
-    if( delay != 0 )
+    if(minX > maxX || minY > maxY) return false;
+
+    *left = minX;
+    *top = minY;
+    *subWidth = maxX - minX + 1;
+    *subHeight = maxY - minY + 1;
+    return true;
+}
+
+// Copies a rectangle out of an RGBA image into a tightly packed buffer
+void GifCopyRect( uint8_t* dst, const uint8_t* src, uint32_t srcWidth, uint32_t left, uint32_t top, uint32_t width, uint32_t height )
+{
+    for( uint32_t yy=0; yy<height; ++yy )
     {
-        // animation header
-        fputc(0x21, writer->f); // extension
-        fputc(0xff, writer->f); // application specific
-        fputc(11, writer->f); // length 11
-        fputs("NETSCAPE2.0", writer->f); // yes, really
-        fputc(3, writer->f); // 3 bytes of NETSCAPE2.0 data
+        memcpy(dst + (size_t)yy*width*4, src + ((size_t)(top+yy)*srcWidth + left)*4, (size_t)width*4);
+    }
+}
 
-        fputc(1, writer->f); // this is the Netscape 2.0 sub-block ID and it must be 1, otherwise some viewers error
-        fputc(0, writer->f); // loop infinitely (byte 0)
-        fputc(0, writer->f); // loop infinitely (byte 1)
+// Makes sure the encoder's scratch memory can hold imageSize bytes of frames.
+bool GifReserveEncoder( GifEncoder* encoder, size_t imageSize )
+{
+    if(!encoder->lzwTable) encoder->lzwTable = (GifLzwTable*)GIF_MALLOC(sizeof(GifLzwTable));
+    if(!encoder->cache) encoder->cache = (GifColorCache*)GIF_MALLOC(sizeof(GifColorCache));
+    if(imageSize > encoder->imageSize)
+    {
+        GIF_FREE(encoder->image);
+        encoder->image = (uint8_t*)GIF_MALLOC(imageSize);
+        encoder->imageSize = encoder->image? imageSize : 0;
+    }
+    return encoder->lzwTable && encoder->cache && encoder->image;
+}
 
-        fputc(0, writer->f); // block terminator
+// Palettizes and LZW-compresses a single frame (graphics control extension, image descriptor,
+// local palette and image data) and appends it to out without flushing it.
+// prevImage is the frame the canvas will show when this one is drawn (i.e. the previous
+// frame was written with kGifDisposeNone), or NULL to draw the full frame. Pixels unchanged
+// from prevImage are written as transparent so the canvas shows through.
+// This touches no GifWriter state, so independent frames may be encoded concurrently
+// (e.g. each into its own memory GifBuffer) as long as every thread passes its own encoder.
+// The result can be spliced into a GIF in progress with GifWriteEncodedFrame(). If the
+// encoder's scratch memory cannot be allocated, out is marked failed.
+// Given a globalPalette (read-only, so it may be shared between threads) the frame is mapped
+// onto it and written without a local palette; bitDepth is then ignored. If the palette is
+// marked indexed, the frame must already hold palette indices in place of alpha (0 for
+// transparent pixels) and is written as is.
+void GifEncodeFrame( GifEncoder* encoder, GifBuffer* out, const uint8_t* prevImage, const uint8_t* image, uint32_t width, uint32_t height, uint32_t delay, int disposal, int bitDepth, bool dither, const GifGlobalPalette* globalPalette )
+{
+    // Only the part of the canvas the frame actually draws is encoded. When the frame will be
+    // disposed to the background that rectangle is also what gets cleared, so it has to cover
+    // every opaque pixel rather than just the changed ones.
+    uint32_t left = 0, top = 0, subWidth = 1, subHeight = 1;
+    GifFindFrameBounds((disposal == kGifDisposeBackground? NULL : prevImage), image, width, height, &left, &top, &subWidth, &subHeight);
+
+    // the palettized frame, then copies of the image's and prevImage's sub-rectangles
+    const size_t subSize = (size_t)subWidth*subHeight*4;
+    const bool cropped = subWidth != width || subHeight != height;
+    if(!GifReserveEncoder(encoder, subSize * (cropped? (prevImage? 3 : 2) : 1)))
+    {
+        out->failed = true;
+        return;
     }
 
+    uint8_t* outFrame = encoder->image;
+    const uint8_t* subImage = image;
+    const uint8_t* subPrev = prevImage;
+    if(cropped)
+    {
+        uint8_t* subBuffer = outFrame + subSize;
+        GifCopyRect(subBuffer, image, width, left, top, subWidth, subHeight);
+        subImage = subBuffer;
+        if(prevImage)
+        {
+            GifCopyRect(subBuffer + subSize, prevImage, width, left, top, subWidth, subHeight);
+            subPrev = subBuffer + subSize;
+        }
+    }
+
+    // Frames with few enough colors get an exact palette: lossless, no median cut and no tree
+    // search (there is also nothing to dither). Otherwise quantize as usual.
+    GifColorCache* cache = encoder->cache;
+    GifPalette pal;
+    if(globalPalette)
+    {
+        pal = globalPalette->pal;
+        if(globalPalette->indexed)
+        {
+            GifCopyIndexedImage(subPrev, subImage, outFrame, subWidth, subHeight, &pal);
+        }
+        else if(dither && !globalPalette->exact)
+        {
+            GifDitherImage(subPrev, subImage, outFrame, subWidth, subHeight, &pal);
+        }
+        else
+        {
+            memcpy(cache, &globalPalette->cache, sizeof(GifColorCache));
+            GifThresholdImage(subPrev, subImage, outFrame, subWidth, subHeight, &pal, cache);
+        }
+    }
+    else if(GifMakeExactPalette(encoder, subPrev, subImage, subWidth, subHeight, bitDepth, &pal, cache))
+    {
+        GifThresholdImage(subPrev, subImage, outFrame, subWidth, subHeight, &pal, cache);
+    }
+    else
+    {
+        GifMakePalette(encoder, (dither? NULL : subPrev), subImage, subWidth, subHeight, bitDepth, dither, &pal);
+
+        if(dither)
+        {
+            GifDitherImage(subPrev, subImage, outFrame, subWidth, subHeight, &pal);
+        }
+        else
+        {
+            GifClearColorCache(cache);
+            GifThresholdImage(subPrev, subImage, outFrame, subWidth, subHeight, &pal, cache);
+        }
+    }
+#ifdef GIF_FLIP_VERT
+    // the image is stored bottom-up, but the descriptor is in top-down canvas space
+    top = height - top - subHeight;
+#endif
+    GifWriteLzwImage(out, encoder->lzwTable, outFrame, left, top, subWidth, subHeight, delay, disposal, &pal, globalPalette == NULL);
+}
+
+// Changes the delay of a frame produced by GifEncodeFrame, so its bytes can be written again
+// for a repeat of the frame that is shown for a different time.
+void GifSetEncodedFrameDelay( uint8_t* data, uint32_t delay )
+{
+    // graphics control extension: 0x21 0xf9 0x04, flags, then the delay
+    data[4] = delay & 0xff;
+    data[5] = (delay >> 8) & 0xff;
+}
+
+// Switches a writer created by GifBegin to delta encoding: frames are left on the canvas
+// and the next frame stores only the pixels that changed, unless some pixel turns
+// transparent, in which case the canvas is cleared in between and that frame is drawn in full.
+// Must be called before the first frame is written.
+bool GifSetDeltaEncoding( GifWriter* writer, uint32_t width, uint32_t height )
+{
+    if(!writer->isOpen || !writer->firstFrame) return false;
+
+    writer->firstImage = (uint8_t*)GIF_MALLOC(width*height*4);
+    writer->lastImage = (uint8_t*)GIF_MALLOC(width*height*4);
+    writer->pendingImage = (uint8_t*)GIF_MALLOC(width*height*4);
+    if(!writer->firstImage || !writer->lastImage || !writer->pendingImage)
+    {
+        GIF_FREE(writer->firstImage);
+        GIF_FREE(writer->lastImage);
+        GIF_FREE(writer->pendingImage);
+        writer->firstImage = writer->lastImage = writer->pendingImage = NULL;
+        return false;
+    }
+
+    writer->deltaEncode = true;
     return true;
 }
 
+// Encodes the frame held back by a delta-encoding writer, now that the frame after it is known.
+void GifFlushPendingFrame( GifWriter* writer, const uint8_t* nextImage )
+{
+    const uint32_t numPixels = writer->pendingWidth * writer->pendingHeight;
+    const bool keep = !GifNeedsClear(writer->pendingImage, nextImage, numPixels);
+
+    GifEncodeFrame(&writer->encoder, &writer->out, (writer->lastKept? writer->lastImage : NULL), writer->pendingImage,
+                   writer->pendingWidth, writer->pendingHeight, writer->pendingDelay,
+                   (keep? kGifDisposeNone : kGifDisposeBackground), writer->pendingBitDepth, writer->pendingDither,
+                   writer->globalPalette);
+
+    // the pending frame is now what the canvas shows
+    uint8_t* swap = writer->lastImage;
+    writer->lastImage = writer->pendingImage;
+    writer->pendingImage = swap;
+    writer->lastKept = keep;
+    writer->hasPending = false;
+}
+
 // Writes out a new frame to a GIF in progress.
 // The GIFWriter should have been created by GIFBegin.
 // AFAIK, it is legal to use different bit depths for different frames of an image -
 // this may be handy to save bits in animations that don't change much.
 bool GifWriteFrame( GifWriter* writer, const uint8_t* image, uint32_t width, uint32_t height, uint32_t delay, int bitDepth, bool dither )
 {
-    if(!writer->f) return false;
+    if(!writer->isOpen) return false;
+    if(writer->firstFrame) GifWriteHeader(writer);
+
+    if(writer->deltaEncode)
+    {
+        if(writer->firstFrame)
+            memcpy(writer->firstImage, image, width*height*4);
+        else if(writer->hasPending)
+            GifFlushPendingFrame(writer, image);
+
+        memcpy(writer->pendingImage, image, width*height*4);
+        writer->pendingWidth = width;
+        writer->pendingHeight = height;
+        writer->pendingDelay = delay;
+        writer->pendingBitDepth = bitDepth;
+        writer->pendingDither = dither;
+        writer->hasPending = true;
+        writer->firstFrame = false;
+        return GifFlushBuffer(&writer->out);
+    }
 
-    const uint8_t* oldImage = NULL; // render full frames; do not delta-encode
     writer->firstFrame = false;
 
-    GifPalette pal;
-    GifMakePalette((dither? NULL : oldImage), image, width, height, bitDepth, dither, &pal);
+    GifEncodeFrame(&writer->encoder, &writer->out, NULL, image, width, height, delay, kGifDisposeBackground, bitDepth, dither, writer->globalPalette);
 
-    if(dither)
-        GifDitherImage(oldImage, image, writer->oldImage, width, height, &pal);
-    else
-        GifThresholdImage(oldImage, image, writer->oldImage, width, height, &pal);
+    return GifFlushBuffer(&writer->out);
+}
 
-    GifWriteLzwImage(writer->f, writer->oldImage, 0, 0, width, height, delay, &pal);
+// Appends a frame previously produced by GifEncodeFrame to a GIF in progress.
+bool GifWriteEncodedFrame( GifWriter* writer, const uint8_t* data, size_t size )
+{
+    if(!writer->isOpen) return false;
+    if(writer->firstFrame) GifWriteHeader(writer);
 
-    return true;
+    writer->firstFrame = false;
+
+    GifPutBytes(&writer->out, data, size);
+    return GifFlushBuffer(&writer->out);
 }
 
 // Writes the EOF code, closes the file handle, and frees temp memory used by a GIF.
 // Many if not most viewers will still display a GIF properly if the EOF code is missing,
 // but it's still a good idea to write it out.
+// Returns false if any output could not be written. A memory sink's bytes are kept in
+// writer->out for the caller.
 bool GifEnd( GifWriter* writer )
 {
-    if(!writer->f) return false;
+    if(!writer->isOpen) return false;
+    if(writer->firstFrame) GifWriteHeader(writer);
+
+    // the animation loops, so the last frame is followed by the first
+    if(writer->hasPending) GifFlushPendingFrame(writer, writer->firstImage);
 
-    fputc(0x3b, writer->f); // end of file
-    fclose(writer->f);
-    GIF_FREE(writer->oldImage);
+    GifPutByte(&writer->out, 0x3b); // end of file
+    bool ok = GifFlushBuffer(&writer->out);
+    if(writer->out.write) GifFreeBuffer(&writer->out);
+    if(writer->f && fclose(writer->f) != 0) ok = false;
+
+    GifFreeEncoder(&writer->encoder);
+    GIF_FREE(writer->firstImage);
+    GIF_FREE(writer->lastImage);
+    GIF_FREE(writer->pendingImage);
 
     writer->f = NULL;
-    writer->oldImage = NULL;
+    writer->isOpen = false;
+    writer->globalPalette = NULL;
+    writer->firstImage = NULL;
+    writer->lastImage = NULL;
+    writer->pendingImage = NULL;
 
-    return true;
+    return ok;
 }
 
 #endif
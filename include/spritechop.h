@@ -0,0 +1,185 @@
+// spritechop.h - cut animated GIFs out of sprite sheets.
+//
+// The library behind the spritechop command line tool. A sheet is loaded once and any number
+// of animations can then be cut from it, in memory or through a write callback, without
+// starting a process or decoding the image again.
+//
+// Typical use:
+//
+//     sc_context *ctx = sc_context_create(0);
+//     sc_sheet *sheet;
+//     if (sc_sheet_load(ctx, "ninja.png", NULL, &sheet) != SC_OK) {
+//         fprintf(stderr, "%s\n", sc_context_error(ctx));
+//     }
+//     sc_point points[] = { { 35, 24 }, { 159, 24 } };
+//     sc_animation anim;
+//     sc_animation_init(&anim, 80, 114, points, 2);
+//     uint8_t *gif;
+//     size_t size;
+//     if (sc_encode_gif_to_buffer(ctx, sheet, &anim, &gif, &size, NULL) == SC_OK) {
+//         ...
+//         sc_free(gif);
+//     }
+//     sc_sheet_free(sheet);
+//     sc_context_destroy(ctx);
+//
+// A context is not thread-safe: use one per thread. A loaded sheet is read-only and may be
+// shared by contexts on any number of threads, except while sc_sheet_apply_key() runs.
+
+#ifndef SPRITECHOP_H
+#define SPRITECHOP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define SC_API __attribute__((visibility("default")))
+#else
+#define SC_API
+#endif
+
+// Bumped on incompatible changes to anything declared here.
+#define SC_API_VERSION 1
+
+typedef enum {
+    SC_OK = 0,
+    SC_ERROR_INVALID_ARGUMENT, // bad sizes, no frames or a NULL pointer
+    SC_ERROR_LOAD_FAILED,      // the sheet could not be read or decoded
+    SC_ERROR_OUT_OF_BOUNDS,    // a frame reaches outside the sheet
+    SC_ERROR_OUT_OF_MEMORY,
+    SC_ERROR_THREAD_FAILED,    // no encoding thread could be started
+    SC_ERROR_WRITE_FAILED,     // the write callback failed
+    SC_ERROR_CACHE_FAILED,     // the frame cache directory could not be created
+} sc_status;
+
+typedef struct sc_context sc_context;
+typedef struct sc_sheet sc_sheet;
+
+typedef struct {
+    int x;
+    int y;
+} sc_point;
+
+// Half-open pixel rectangle [x0, x1) x [y0, y1).
+typedef struct {
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+} sc_rect;
+
+// Everything needed to cut one animation from a sheet. Fill it with sc_animation_init() and
+// then change what differs from the defaults.
+typedef struct {
+    int frame_w;                 // size of each frame on the sheet
+    int frame_h;
+    int output_w;                // size of each frame in the GIF (nearest-neighbour scaled)
+    int output_h;
+    uint32_t delay_cs;           // frame delay in centiseconds
+    bool transparency_color_set; // pixels of this color become transparent
+    uint8_t transparency_r;
+    uint8_t transparency_g;
+    uint8_t transparency_b;
+    bool delta;                  // store only the pixels that change between frames
+    bool global_palette;         // one color table shared by all frames
+    bool keep_palette;           // reuse an indexed PNG sheet's palette as is
+    const sc_point *points;      // top-left corner of each frame on the sheet
+    int frame_count;
+} sc_animation;
+
+// Filled in by the encoders for callers that want to report what happened.
+typedef struct {
+    size_t size;       // bytes of GIF produced
+    bool palette_kept; // keep_palette was honoured rather than falling back to quantizing
+} sc_encode_info;
+
+// Receives finished GIF bytes a frame at a time; returns false to abort encoding.
+typedef bool (*sc_write_func)(void *user, const uint8_t *data, size_t size);
+
+// Creates a context with the given number of encoding threads (0 = one per CPU). The
+// context keeps the last error message and scratch buffers that are reused between calls.
+// Returns NULL if out of memory.
+SC_API sc_context *sc_context_create(int jobs);
+SC_API void sc_context_destroy(sc_context *ctx);
+
+// The message for the last failed call made with ctx, or "" if there was none.
+SC_API const char *sc_context_error(const sc_context *ctx);
+
+// Keeps every frame ctx encodes in dir, created if missing, and takes frames from there instead
+// of encoding them again whenever their pixels and encoding settings match, in this process or
+// a later one. Sheets loaded from files are kept there too, decoded, and mapped read-only by
+// later loads of the same unchanged file instead of being decoded again. Entries are renamed
+// into place whole, so concurrent processes may share a directory. An entry whose recorded key
+// matches is used as is, so the directory must not be writable by anyone you would not let
+// write your output. NULL turns the cache off.
+SC_API sc_status sc_context_set_cache(sc_context *ctx, const char *dir);
+
+// Lets sheets loaded with ctx keep reading from their input file: files are mapped instead of
+// read, and uncompressed 32-bit TGA/BMP sheets are cropped straight out of the mapping instead
+// of copied. Such a sheet changes when the file is modified in place, and reading it after the
+// file is truncated kills the process with SIGBUS, so only turn this on for sheets freed before
+// the file can change, like those of a one-shot command-line run. Off by default.
+SC_API void sc_context_set_file_backed(sc_context *ctx, bool file_backed);
+
+// Loads the sheet at path ("-" for stdin). If region is given, only that part of the sheet is
+// guaranteed to be usable afterwards, which lets formats that allow it skip decoding the rest;
+// frames outside it must not be cut from the sheet. With a cache (sc_context_set_cache()), a
+// sheet that has to be decoded is decoded whole, so that its cached copy serves every region.
+// Unless ctx is file-backed (sc_context_set_file_backed()), the sheet holds a private copy of
+// its pixels and never reads the file again, so it can be kept while the file is edited; a
+// sheet mapped from the cache reads an entry that is only ever replaced, never changed.
+SC_API sc_status sc_sheet_load(sc_context *ctx, const char *path, const sc_rect *region, sc_sheet **sheet);
+
+// Like sc_sheet_load(), from an encoded image in memory. The data is copied.
+SC_API sc_status sc_sheet_load_memory(sc_context *ctx, const uint8_t *data, size_t size, const sc_rect *region, sc_sheet **sheet);
+
+SC_API void sc_sheet_free(sc_sheet *sheet);
+
+// Size of the whole sheet, whether or not all of it was decoded.
+SC_API void sc_sheet_size(const sc_sheet *sheet, int *w, int *h);
+
+// Bytes the sheet holds: its decoded pixels, or the mapped file they are read from in place
+// when it was loaded file-backed.
+SC_API size_t sc_sheet_memory(const sc_sheet *sheet);
+
+// Makes every pixel of the given color transparent in the sheet itself, so that animations
+// keyed with that color skip keying their frames. This is only possible for sheets decoded to
+// RGBA; returns false, changing nothing, for any other sheet.
+SC_API bool sc_sheet_apply_key(sc_sheet *sheet, uint8_t r, uint8_t g, uint8_t b);
+
+// Compares the pixels of two loads of a sheet within region and fills dirty with up to
+// max_dirty rectangles covering every pixel that changed, made of whole 32x32 tiles; when more
+// would be needed, a single rectangle bounds them all. *dirty_count is 0 when nothing changed.
+// Everything counts as changed if the sheets differ in size or either lacks part of region.
+SC_API sc_status sc_sheet_diff(sc_context *ctx, const sc_sheet *a, const sc_sheet *b, sc_rect region, sc_rect *dirty, int max_dirty, int *dirty_count);
+
+// Sets frame and output size to frame_w x frame_h and the delay to 8 cs, with no
+// transparency color and all options off.
+SC_API void sc_animation_init(sc_animation *anim, int frame_w, int frame_h, const sc_point *points, int frame_count);
+
+// The smallest rectangle holding every frame of anim; pass it (or a union of several) to
+// sc_sheet_load() to decode no more than that.
+SC_API sc_rect sc_animation_bounds(const sc_animation *anim);
+
+// Crops, scales and color-keys every frame of anim into pixels: frame_count RGBA images of
+// output_w x output_h, one after another.
+SC_API sc_status sc_extract_frames(sc_context *ctx, const sc_sheet *sheet, const sc_animation *anim, uint8_t *pixels);
+
+// Encodes anim as a GIF, handing it to write() a frame at a time. info may be NULL.
+SC_API sc_status sc_encode_gif(sc_context *ctx, const sc_sheet *sheet, const sc_animation *anim, sc_write_func write, void *user, sc_encode_info *info);
+
+// Encodes anim as a GIF into a new buffer, which the caller releases with sc_free().
+SC_API sc_status sc_encode_gif_to_buffer(sc_context *ctx, const sc_sheet *sheet, const sc_animation *anim, uint8_t **data, size_t *size, sc_encode_info *info);
+
+SC_API void sc_free(void *data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,2237 @@
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700 // realpath()
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#if defined(__SSE2__)
+#define SPRITECHOP_SSE2 1
+#endif
+#if defined(__GNUC__)
+#define SPRITECHOP_AVX2 1
+#endif
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SPRITECHOP_NEON 1
+#endif
+
+#include "include/spritechop.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "include/stb_image.h"
+
+#define GIF_H_IMPLEMENTATION
+#include "include/gif.h"
+
+// How a sheet's pixels are stored: decoded at the image's own channel count (or as palette
+// indices), or 32-bit pixels read in place from an uncompressed TGA/BMP file. Pixels are only
+// expanded to RGBA a frame row at a time.
+typedef enum {
+    SHEET_GRAY,
+    SHEET_GRAY_ALPHA,
+    SHEET_RGB,
+    SHEET_RGBA,
+    SHEET_BGRA,
+    SHEET_INDEXED,
+} SheetFormat;
+
+// A sprite sheet, shared read-only by every animation cut from it. Only `region` of the
+// w x h sheet may be held in memory: its top-left pixel is at pixels, and rows are stride
+// bytes apart (negative for files stored bottom-up).
+// keyed is set when key (a transparency color) was applied to the whole sheet up front, opaque
+// when the stored alpha must be ignored. Gray and RGB pixels equal to png_key (a PNG tRNS
+// color) are transparent when has_png_key is set.
+struct sc_sheet {
+    const uint8_t *pixels;
+    ptrdiff_t stride;
+    int w;
+    int h;
+    sc_rect region;
+    SheetFormat format;
+    bool opaque;
+    bool keyed;
+    uint8_t key[3];
+    bool has_png_key;
+    uint8_t png_key[3];
+    uint8_t palette[256][4]; // RGBA entries of an indexed sheet
+    uint8_t *decoded;   // owned decoded pixels, if any
+    uint8_t *file_data; // owned contents of the input file or its cached decode, mapped or read into memory
+    size_t file_size;
+    bool file_mapped;
+};
+
+// "-" names stdin or stdout.
+static bool is_stdio_path(const char *path) {
+    return strcmp(path, "-") == 0;
+}
+
+// Nearest-neighbour mapping between two frame sizes, computed once per animation and shared
+// read-only by every worker. x_factor is the horizontal upscale ratio when it is an integer
+// (1 = same width), else 0 and rows are scaled through the src_x table.
+typedef struct {
+    int src_w;
+    int src_h;
+    int dst_w;
+    int dst_h;
+    int x_factor;
+    int *src_x;
+    int *src_y;
+} Scaler;
+
+static bool scaler_init(Scaler *scaler, int src_w, int src_h, int dst_w, int dst_h) {
+    scaler->src_w = src_w;
+    scaler->src_h = src_h;
+    scaler->dst_w = dst_w;
+    scaler->dst_h = dst_h;
+    scaler->x_factor = dst_w % src_w == 0 ? dst_w / src_w : 0;
+    scaler->src_x = (int *)malloc(sizeof(int) * (size_t)dst_w);
+    scaler->src_y = (int *)malloc(sizeof(int) * (size_t)dst_h);
+    if (!scaler->src_x || !scaler->src_y) {
+        free(scaler->src_x);
+        free(scaler->src_y);
+        scaler->src_x = scaler->src_y = NULL;
+        return false;
+    }
+    for (int x = 0; x < dst_w; ++x) {
+        scaler->src_x[x] = (int)(((int64_t)x * src_w) / dst_w);
+    }
+    for (int y = 0; y < dst_h; ++y) {
+        scaler->src_y[y] = (int)(((int64_t)y * src_h) / dst_h);
+    }
+    return true;
+}
+
+static void scaler_free(Scaler *scaler) {
+    free(scaler->src_x);
+    free(scaler->src_y);
+}
+
+// Pixels are moved as whole 32-bit words; memcpy keeps this free of alignment and aliasing issues.
+static inline uint32_t load_px(const uint8_t *p) {
+    uint32_t px;
+    memcpy(&px, p, 4);
+    return px;
+}
+
+static inline void store_px(uint8_t *p, uint32_t px) {
+    memcpy(p, &px, 4);
+}
+
+static void scale_row(const Scaler *scaler, const uint8_t *src_row, uint8_t *dst_row) {
+    const int src_w = scaler->src_w;
+    switch (scaler->x_factor) {
+    case 1:
+        memcpy(dst_row, src_row, (size_t)src_w * 4);
+        break;
+    case 2:
+        for (int x = 0; x < src_w; ++x, dst_row += 8) {
+            const uint32_t px = load_px(src_row + (size_t)x * 4);
+            store_px(dst_row, px);
+            store_px(dst_row + 4, px);
+        }
+        break;
+    case 3:
+        for (int x = 0; x < src_w; ++x, dst_row += 12) {
+            const uint32_t px = load_px(src_row + (size_t)x * 4);
+            store_px(dst_row, px);
+            store_px(dst_row + 4, px);
+            store_px(dst_row + 8, px);
+        }
+        break;
+    case 4:
+        for (int x = 0; x < src_w; ++x, dst_row += 16) {
+            const uint32_t px = load_px(src_row + (size_t)x * 4);
+            store_px(dst_row, px);
+            store_px(dst_row + 4, px);
+            store_px(dst_row + 8, px);
+            store_px(dst_row + 12, px);
+        }
+        break;
+    case 0:
+        for (int x = 0; x < scaler->dst_w; ++x) {
+            store_px(dst_row + (size_t)x * 4, load_px(src_row + (size_t)scaler->src_x[x] * 4));
+        }
+        break;
+    default:
+        for (int x = 0; x < src_w; ++x) {
+            const uint32_t px = load_px(src_row + (size_t)x * 4);
+            for (int k = 0; k < scaler->x_factor; ++k, dst_row += 4) {
+                store_px(dst_row, px);
+            }
+        }
+        break;
+    }
+}
+
+static bool frame_in_bounds(int src_w, int src_h, int frame_w, int frame_h, sc_point origin) {
+    if (origin.x < 0 || origin.y < 0) {
+        return false;
+    }
+    return origin.x + frame_w <= src_w && origin.y + frame_h <= src_h;
+}
+
+// Color keying compares whole RGBA pixels as 32-bit words: a pixel is keyed when
+// (pixel & rgb_mask) == key, and keying clears the bits in alpha_mask. The masks are built
+// from byte arrays so the comparison works regardless of byte order.
+typedef void (*TransparencyKernel)(uint8_t *pixels, size_t count, uint32_t key, uint32_t rgb_mask, uint32_t alpha_mask);
+
+static void key_pixels_scalar(uint8_t *pixels, size_t count, uint32_t key, uint32_t rgb_mask, uint32_t alpha_mask) {
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t px;
+        memcpy(&px, pixels + i * 4, 4);
+        if ((px & rgb_mask) == key) {
+            px &= ~alpha_mask;
+            memcpy(pixels + i * 4, &px, 4);
+        }
+    }
+}
+
+#if SPRITECHOP_SSE2
+// 16 pixels per iteration.
+static void key_pixels_sse2(uint8_t *pixels, size_t count, uint32_t key, uint32_t rgb_mask, uint32_t alpha_mask) {
+    const __m128i vkey = _mm_set1_epi32((int)key);
+    const __m128i vrgb = _mm_set1_epi32((int)rgb_mask);
+    const __m128i valpha = _mm_set1_epi32((int)alpha_mask);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i *p = (__m128i *)(pixels + i * 4);
+        for (int k = 0; k < 4; ++k) {
+            const __m128i px = _mm_loadu_si128(p + k);
+            const __m128i hit = _mm_cmpeq_epi32(_mm_and_si128(px, vrgb), vkey);
+            _mm_storeu_si128(p + k, _mm_andnot_si128(_mm_and_si128(hit, valpha), px));
+        }
+    }
+    key_pixels_scalar(pixels + i * 4, count - i, key, rgb_mask, alpha_mask);
+}
+#endif
+
+#if SPRITECHOP_AVX2
+// 32 pixels per iteration; only selected when the CPU reports AVX2 support.
+__attribute__((target("avx2")))
+static void key_pixels_avx2(uint8_t *pixels, size_t count, uint32_t key, uint32_t rgb_mask, uint32_t alpha_mask) {
+    const __m256i vkey = _mm256_set1_epi32((int)key);
+    const __m256i vrgb = _mm256_set1_epi32((int)rgb_mask);
+    const __m256i valpha = _mm256_set1_epi32((int)alpha_mask);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i *p = (__m256i *)(pixels + i * 4);
+        for (int k = 0; k < 4; ++k) {
+            const __m256i px = _mm256_loadu_si256(p + k);
+            const __m256i hit = _mm256_cmpeq_epi32(_mm256_and_si256(px, vrgb), vkey);
+            _mm256_storeu_si256(p + k, _mm256_andnot_si256(_mm256_and_si256(hit, valpha), px));
+        }
+    }
+    key_pixels_scalar(pixels + i * 4, count - i, key, rgb_mask, alpha_mask);
+}
+#endif
+
+#if SPRITECHOP_NEON
+// 16 pixels per iteration. NEON is part of the baseline wherever the compiler enables it.
+static void key_pixels_neon(uint8_t *pixels, size_t count, uint32_t key, uint32_t rgb_mask, uint32_t alpha_mask) {
+    const uint32x4_t vkey = vdupq_n_u32(key);
+    const uint32x4_t vrgb = vdupq_n_u32(rgb_mask);
+    const uint32x4_t valpha = vdupq_n_u32(alpha_mask);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint32_t *p = (uint32_t *)(void *)(pixels + i * 4);
+        for (int k = 0; k < 4; ++k) {
+            const uint32x4_t px = vreinterpretq_u32_u8(vld1q_u8((const uint8_t *)(p + k * 4)));
+            const uint32x4_t hit = vceqq_u32(vandq_u32(px, vrgb), vkey);
+            vst1q_u8((uint8_t *)(p + k * 4), vreinterpretq_u8_u32(vbicq_u32(px, vandq_u32(hit, valpha))));
+        }
+    }
+    key_pixels_scalar(pixels + i * 4, count - i, key, rgb_mask, alpha_mask);
+}
+#endif
+
+static TransparencyKernel transparency_kernel = key_pixels_scalar;
+static pthread_once_t transparency_kernel_once = PTHREAD_ONCE_INIT;
+
+static void select_transparency_kernel(void) {
+#if SPRITECHOP_SSE2
+    transparency_kernel = key_pixels_sse2;
+#endif
+#if SPRITECHOP_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        transparency_kernel = key_pixels_avx2;
+    }
+#endif
+#if SPRITECHOP_NEON
+    transparency_kernel = key_pixels_neon;
+#endif
+}
+
+static void apply_transparency_color(uint8_t *pixels, size_t count, uint8_t r, uint8_t g, uint8_t b) {
+    const uint8_t key_bytes[4] = { r, g, b, 0 };
+    const uint8_t rgb_bytes[4] = { 0xff, 0xff, 0xff, 0 };
+    const uint8_t alpha_bytes[4] = { 0, 0, 0, 0xff };
+    uint32_t key, rgb_mask, alpha_mask;
+    memcpy(&key, key_bytes, 4);
+    memcpy(&rgb_mask, rgb_bytes, 4);
+    memcpy(&alpha_mask, alpha_bytes, 4);
+
+    pthread_once(&transparency_kernel_once, select_transparency_kernel);
+    transparency_kernel(pixels, count, key, rgb_mask, alpha_mask);
+}
+
+static int sheet_pixel_size(SheetFormat format) {
+    switch (format) {
+    case SHEET_GRAY:
+    case SHEET_INDEXED:
+        return 1;
+    case SHEET_GRAY_ALPHA:
+        return 2;
+    case SHEET_RGB:
+        return 3;
+    default:
+        return 4;
+    }
+}
+
+static SheetFormat sheet_format_for_channels(int channels) {
+    static const SheetFormat formats[4] = { SHEET_GRAY, SHEET_GRAY_ALPHA, SHEET_RGB, SHEET_RGBA };
+    return formats[channels - 1];
+}
+
+// Returns `count` RGBA pixels of the sheet starting at (x, y): straight from the sheet when it
+// is stored as RGBA, otherwise converted into scratch the way stb_image expands channels.
+static const uint8_t *sheet_row(const sc_sheet *sheet, int x, int y, int count, uint8_t *scratch) {
+    const uint8_t *src = sheet->pixels + (ptrdiff_t)(y - sheet->region.y0) * sheet->stride + (ptrdiff_t)(x - sheet->region.x0) * sheet_pixel_size(sheet->format);
+    const uint8_t *key = sheet->png_key;
+    switch (sheet->format) {
+    case SHEET_GRAY:
+        for (int i = 0; i < count; ++i, ++src) {
+            scratch[i * 4 + 0] = scratch[i * 4 + 1] = scratch[i * 4 + 2] = src[0];
+            scratch[i * 4 + 3] = sheet->has_png_key && src[0] == key[0] ? 0 : 0xff;
+        }
+        break;
+    case SHEET_GRAY_ALPHA:
+        for (int i = 0; i < count; ++i, src += 2) {
+            scratch[i * 4 + 0] = scratch[i * 4 + 1] = scratch[i * 4 + 2] = src[0];
+            scratch[i * 4 + 3] = src[1];
+        }
+        break;
+    case SHEET_RGB:
+        for (int i = 0; i < count; ++i, src += 3) {
+            scratch[i * 4 + 0] = src[0];
+            scratch[i * 4 + 1] = src[1];
+            scratch[i * 4 + 2] = src[2];
+            scratch[i * 4 + 3] = sheet->has_png_key && src[0] == key[0] && src[1] == key[1] && src[2] == key[2] ? 0 : 0xff;
+        }
+        break;
+    case SHEET_INDEXED:
+        for (int i = 0; i < count; ++i) {
+            memcpy(scratch + i * 4, sheet->palette[src[i]], 4);
+        }
+        break;
+    case SHEET_RGBA:
+        return src;
+    case SHEET_BGRA:
+        for (int i = 0; i < count; ++i, src += 4) {
+            scratch[i * 4 + 0] = src[2];
+            scratch[i * 4 + 1] = src[1];
+            scratch[i * 4 + 2] = src[0];
+            scratch[i * 4 + 3] = sheet->opaque ? 0xff : src[3];
+        }
+        break;
+    }
+    return scratch;
+}
+
+static uint32_t read_le16(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8);
+}
+
+static uint32_t read_le32(const uint8_t *p) {
+    return read_le16(p) | (read_le16(p + 2) << 16);
+}
+
+// Recognizes uncompressed 32-bit TGA and BMP files, whose pixels can be cropped straight out
+// of the file, and describes them the way stb_image would decode them.
+static bool map_direct_sheet(const uint8_t *data, size_t size, sc_sheet *sheet) {
+    size_t offset;
+    uint32_t w, h;
+    bool top_down;
+    bool opaque;
+    bool scan_alpha = false;
+    if (size >= 18 && data[1] == 0 && data[2] == 2 && data[16] == 32) {
+        // TGA: no color map, truecolor, not RLE. A zero color-map type byte also rules out
+        // every other format stb_image knows, which all start with two printable magic bytes.
+        offset = 18 + (size_t)data[0];
+        w = read_le16(data + 12);
+        h = read_le16(data + 14);
+        top_down = (data[17] & 0x20) != 0;
+        opaque = false;
+    } else if (size >= 54 && data[0] == 'B' && data[1] == 'M' && read_le16(data + 28) == 32 && read_le16(data + 26) == 1) {
+        const uint32_t header_size = read_le32(data + 14);
+        const uint32_t compression = read_le32(data + 30);
+        if (header_size != 40 && header_size != 56 && header_size != 108 && header_size != 124) {
+            return false;
+        }
+        if (compression == 0) {
+            // BGRA, but stb_image treats an all-zero alpha channel as opaque
+            opaque = true;
+            scan_alpha = true;
+        } else if (compression == 3 && size >= 54 + 16) {
+            // Bit fields; only the standard byte layout can be read in place. The alpha mask
+            // only counts with a V4/V5 header.
+            const uint8_t *masks = data + 54;
+            const uint32_t alpha_mask = header_size >= 108 ? read_le32(masks + 12) : 0;
+            if (read_le32(masks) != 0x00ff0000u || read_le32(masks + 4) != 0x0000ff00u || read_le32(masks + 8) != 0x000000ffu ||
+                (alpha_mask != 0 && alpha_mask != 0xff000000u)) {
+                return false;
+            }
+            opaque = alpha_mask == 0;
+        } else {
+            return false;
+        }
+        offset = read_le32(data + 10);
+        w = read_le32(data + 18);
+        const int32_t signed_h = (int32_t)read_le32(data + 22);
+        top_down = signed_h < 0;
+        h = top_down ? (uint32_t)0 - (uint32_t)signed_h : (uint32_t)signed_h;
+    } else {
+        return false;
+    }
+
+    if (w == 0 || h == 0 || w > (1u << 24) || h > (1u << 24) || offset > size || (size - offset) / 4 / w < h) {
+        return false;
+    }
+
+    const size_t row_size = (size_t)w * 4;
+    const uint8_t *pixels = data + offset;
+    for (size_t i = 3; scan_alpha && i < row_size * h; i += 4) {
+        // BI_RGB: the alpha bytes count unless every one of them is zero
+        if (pixels[i] != 0) {
+            opaque = false;
+            break;
+        }
+    }
+
+    sheet->w = (int)w;
+    sheet->h = (int)h;
+    sheet->region = (sc_rect){ 0, 0, (int)w, (int)h };
+    sheet->format = SHEET_BGRA;
+    sheet->opaque = opaque;
+    sheet->stride = top_down ? (ptrdiff_t)row_size : -(ptrdiff_t)row_size;
+    sheet->pixels = top_down ? pixels : pixels + row_size * (h - 1);
+    return true;
+}
+
+static uint32_t read_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint8_t paeth_predictor(int a, int b, int c) {
+    const int p = a + b - c;
+    const int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) {
+        return (uint8_t)a;
+    }
+    return (uint8_t)(pb <= pc ? b : c);
+}
+
+// Undoes the PNG filter of one row in place; prior is the previous unfiltered row, or NULL.
+static bool unfilter_png_row(uint8_t filter, uint8_t *cur, const uint8_t *prior, size_t size, int bpp) {
+    switch (filter) {
+    case 0:
+        break;
+    case 1:
+        for (size_t i = (size_t)bpp; i < size; ++i) {
+            cur[i] = (uint8_t)(cur[i] + cur[i - bpp]);
+        }
+        break;
+    case 2:
+        for (size_t i = 0; prior && i < size; ++i) {
+            cur[i] = (uint8_t)(cur[i] + prior[i]);
+        }
+        break;
+    case 3:
+        for (size_t i = 0; i < size; ++i) {
+            const int left = i >= (size_t)bpp ? cur[i - bpp] : 0;
+            const int up = prior ? prior[i] : 0;
+            cur[i] = (uint8_t)(cur[i] + ((left + up) >> 1));
+        }
+        break;
+    case 4:
+        for (size_t i = 0; i < size; ++i) {
+            const int left = i >= (size_t)bpp ? cur[i - bpp] : 0;
+            const int up = prior ? prior[i] : 0;
+            const int up_left = prior && i >= (size_t)bpp ? prior[i - bpp] : 0;
+            cur[i] = (uint8_t)(cur[i] + paeth_predictor(left, up, up_left));
+        }
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+// Decodes just `region` of an 8-bit, non-interlaced PNG, keeping its channels (or palette
+// indices) as stored; sheet_row expands them to the same pixels stb_image produces.
+// Inflating stops after the last row the region needs: stb_image's zlib decoder fails once
+// its fixed buffer is full, and all output before the deflate operation that overflowed is
+// intact, so the buffer gets room for one more maximal (stored) block past the needed rows.
+// Returns false for any other PNG, which the caller then decodes in full.
+static bool decode_png_region(const uint8_t *data, size_t size, sc_rect region, sc_sheet *sheet) {
+    static const uint8_t signature[8] = { 137, 'P', 'N', 'G', 13, 10, 26, 10 };
+    if (size < 8 || memcmp(data, signature, 8) != 0) {
+        return false;
+    }
+
+    uint32_t w = 0, h = 0;
+    int color_type = -1, channels = 0;
+    uint8_t palette[256][4];
+    int palette_size = 0;
+    for (int i = 0; i < 256; ++i) {
+        palette[i][0] = palette[i][1] = palette[i][2] = 0;
+        palette[i][3] = 0xff;
+    }
+    bool has_key = false;
+    uint8_t key[3] = { 0, 0, 0 };
+    const uint8_t *idat = NULL;
+    size_t idat_size = 0;
+    uint8_t *idat_copy = NULL; // IDAT split over several chunks, joined
+    bool ok = true;
+    for (size_t pos = 8; ok;) {
+        if (size - pos < 12 || read_be32(data + pos) > size - pos - 12) {
+            ok = false;
+            break;
+        }
+        const uint32_t len = read_be32(data + pos);
+        const uint8_t *type = data + pos + 4;
+        const uint8_t *body = data + pos + 8;
+        pos += 12 + (size_t)len;
+
+        if (memcmp(type, "IHDR", 4) == 0) {
+            static const int channels_by_type[7] = { 1, 0, 3, 1, 2, 0, 4 };
+            w = len == 13 ? read_be32(body) : 0;
+            h = len == 13 ? read_be32(body + 4) : 0;
+            color_type = len == 13 && body[9] <= 6 ? body[9] : -1;
+            channels = color_type >= 0 ? channels_by_type[color_type] : 0;
+            ok = channels > 0 && body[8] == 8 && body[10] == 0 && body[11] == 0 && body[12] == 0 &&
+                 w > 0 && h > 0 && w <= (1u << 24) && h <= (1u << 24);
+        } else if (memcmp(type, "PLTE", 4) == 0) {
+            palette_size = (int)(len / 3);
+            ok = len % 3 == 0 && palette_size <= 256;
+            for (int i = 0; ok && i < palette_size; ++i) {
+                palette[i][0] = body[i * 3 + 0];
+                palette[i][1] = body[i * 3 + 1];
+                palette[i][2] = body[i * 3 + 2];
+                palette[i][3] = 0xff;
+            }
+        } else if (memcmp(type, "tRNS", 4) == 0) {
+            // 8-bit samples are stored in the low byte of each 16-bit tRNS value
+            if (color_type == 3 && (int)len <= palette_size) {
+                for (uint32_t i = 0; i < len; ++i) {
+                    palette[i][3] = body[i];
+                }
+            } else if (color_type == 0 && len == 2) {
+                key[0] = key[1] = key[2] = body[1];
+                has_key = true;
+            } else if (color_type == 2 && len == 6) {
+                key[0] = body[1];
+                key[1] = body[3];
+                key[2] = body[5];
+                has_key = true;
+            } else {
+                ok = false;
+            }
+        } else if (memcmp(type, "IDAT", 4) == 0) {
+            if (!idat) {
+                idat = body;
+            } else {
+                uint8_t *joined = (uint8_t *)realloc(idat_copy, idat_size + len);
+                ok = joined != NULL;
+                if (ok) {
+                    if (!idat_copy) {
+                        memcpy(joined, idat, idat_size);
+                    }
+                    idat_copy = joined;
+                    idat = joined;
+                }
+            }
+            if (ok) {
+                if (idat_copy) {
+                    memcpy(idat_copy + idat_size, body, len);
+                }
+                idat_size += len;
+            }
+        } else if (memcmp(type, "IEND", 4) == 0) {
+            break;
+        } else {
+            // unknown critical chunks (e.g. Apple's CgBI) change how the image decodes
+            ok = (type[0] & 0x20) != 0;
+        }
+    }
+
+    region.x1 = region.x1 < (int)w ? region.x1 : (int)w;
+    region.y1 = region.y1 < (int)h ? region.y1 : (int)h;
+    ok = ok && idat && channels > 0 && (color_type != 3 || palette_size > 0) &&
+         region.x0 < region.x1 && region.y0 < region.y1 && idat_size <= INT32_MAX;
+
+    const size_t row_size = (size_t)w * (size_t)channels;
+    const size_t total = (row_size + 1) * h;
+    const size_t needed = (row_size + 1) * (size_t)region.y1;
+    const size_t limit = needed + 65536 < total ? needed + 65536 : total;
+    uint8_t *raw = ok && limit <= INT32_MAX ? (uint8_t *)malloc(limit) : NULL;
+    if (raw) {
+        // stbi_zlib_decode_buffer() without discarding how far it got: stb_image's decoder only
+        // advances zout past output that is complete, including when it stops because the
+        // buffer is full, so everything before it is intact whatever the failure was.
+        stbi__zbuf zlib;
+        zlib.zbuffer = (stbi_uc *)idat;
+        zlib.zbuffer_end = (stbi_uc *)idat + idat_size;
+        const bool finished = stbi__do_zlib(&zlib, (char *)raw, (int)limit, 0, 1) != 0;
+        const size_t inflated = (size_t)(zlib.zout - zlib.zout_start);
+        ok = (finished || limit < total) && inflated >= needed;
+    } else {
+        ok = false;
+    }
+    free(idat_copy);
+
+    // Rows are unfiltered in place, and the region's rows and columns are then packed into a
+    // buffer of their own so that the rest of the image can be released.
+    const size_t out_row_size = (size_t)(region.x1 - region.x0) * (size_t)channels;
+    const int out_h = region.y1 - region.y0;
+    uint8_t *out = ok ? (uint8_t *)malloc(out_row_size * (size_t)out_h) : NULL;
+    const uint8_t *prior = NULL;
+    for (int y = 0; out && y < region.y1; ++y) {
+        uint8_t *row = raw + (size_t)y * (row_size + 1);
+        if (!unfilter_png_row(row[0], row + 1, prior, row_size, channels)) {
+            free(out);
+            out = NULL;
+            break;
+        }
+        prior = row + 1;
+        if (y >= region.y0) {
+            memcpy(out + (size_t)(y - region.y0) * out_row_size, row + 1 + (size_t)region.x0 * (size_t)channels, out_row_size);
+        }
+    }
+    free(raw);
+    if (!out) {
+        return false;
+    }
+
+    sheet->w = (int)w;
+    sheet->h = (int)h;
+    sheet->region = region;
+    sheet->decoded = out;
+    sheet->pixels = out;
+    sheet->stride = (ptrdiff_t)out_row_size;
+    sheet->format = color_type == 3 ? SHEET_INDEXED : sheet_format_for_channels(channels);
+    sheet->has_png_key = has_key;
+    memcpy(sheet->png_key, key, sizeof(key));
+    memcpy(sheet->palette, palette, sizeof(palette));
+    return true;
+}
+
+// 128-bit hash of frames, cache keys and cached files, computed a word at a time in two lanes.
+typedef struct {
+    uint64_t lo;
+    uint64_t hi;
+} Hash128;
+
+static Hash128 hash_bytes(Hash128 hash, const uint8_t *data, size_t size) {
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash.lo = (hash.lo ^ word) * 0xff51afd7ed558ccdu;
+        hash.lo ^= hash.lo >> 32;
+        hash.hi = (hash.hi + word) * 0xc4ceb9fe1a85ec53u;
+        hash.hi ^= hash.hi >> 29;
+    }
+    for (; i < size; ++i) {
+        hash.lo = (hash.lo ^ data[i]) * 0x100000001b3u;
+        hash.hi = (hash.hi + data[i]) * 0x9e3779b97f4a7c15u;
+    }
+    return hash;
+}
+
+// Creates the file an entry for `path` in the cache directory is written to before it is
+// renamed into place, named after the process and a per-process counter. Unlike mkstemp(),
+// which always creates files 0600, it leaves the mode to the umask, so other users sharing the
+// directory can read the entries. Returns NULL on failure.
+static FILE *create_cache_temp(const char *path, char temp[PATH_MAX]) {
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    static unsigned long counter;
+    // A crashed process with the same pid may have left its temporaries behind.
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        pthread_mutex_lock(&lock);
+        const unsigned long n = counter++;
+        pthread_mutex_unlock(&lock);
+        if (snprintf(temp, PATH_MAX, "%s.%ld.%lu.tmp", path, (long)getpid(), n) >= PATH_MAX) {
+            return NULL;
+        }
+        const int fd = open(temp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if (fd >= 0) {
+            FILE *f = fdopen(fd, "wb");
+            if (!f) {
+                close(fd);
+                unlink(temp);
+            }
+            return f;
+        }
+        if (errno != EEXIST) {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+// Reads a whole stream into memory.
+static uint8_t *read_stream(FILE *f, size_t *size) {
+    size_t capacity = 1 << 16;
+    uint8_t *data = (uint8_t *)malloc(capacity);
+    *size = 0;
+    while (data) {
+        *size += fread(data + *size, 1, capacity - *size, f);
+        if (*size < capacity) {
+            break;
+        }
+        uint8_t *grown = (uint8_t *)realloc(data, capacity * 2);
+        if (!grown) {
+            free(data);
+            return NULL;
+        }
+        data = grown;
+        capacity *= 2;
+    }
+    if (data && ferror(f)) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+static void release_file_data(sc_sheet *sheet) {
+    if (sheet->file_mapped) {
+        munmap(sheet->file_data, sheet->file_size);
+    } else {
+        free(sheet->file_data);
+    }
+    sheet->file_data = NULL;
+    sheet->file_size = 0;
+    sheet->file_mapped = false;
+}
+
+static void free_sheet(sc_sheet *sheet) {
+    free(sheet->decoded); // stb_image allocates with malloc as well
+    release_file_data(sheet);
+    memset(sheet, 0, sizeof(*sheet));
+}
+
+// Points the sheet at the pixels stb_image decoded in full, or reports why there are none.
+static bool finish_full_decode(sc_sheet *sheet, int channels, const char **reason) {
+    if (!sheet->decoded) {
+        *reason = stbi_failure_reason();
+        return false;
+    }
+    sheet->pixels = sheet->decoded;
+    sheet->region = (sc_rect){ 0, 0, sheet->w, sheet->h };
+    sheet->stride = (ptrdiff_t)sheet->w * channels;
+    sheet->format = sheet_format_for_channels(channels);
+    return true;
+}
+
+// Everything, for callers that do not say which region they need.
+static const sc_rect whole_sheet = { 0, 0, INT_MAX, INT_MAX };
+
+// A decoded sheet kept in the cache directory (see sc_context_set_cache()), so that later loads
+// of the same file map the pixels read-only instead of decoding them again, and processes
+// loading it at the same time share one copy in the page cache. The entry is named after the
+// file's canonical path alone, so a sheet that changes replaces its entry instead of adding
+// one per save (an editor that saves by renaming a new file over the sheet gives it a new
+// inode every time). Its header records the file's size, modification time and a hash of its
+// contents, which must all match.
+typedef struct {
+    char path[PATH_MAX];
+    uint64_t source_size;
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+    Hash128 source_hash;
+} SheetCacheKey;
+
+#define SHEET_CACHE_VERSION 1
+#define SHEET_CACHE_DATA_OFFSET 4096 // pixels start on a page of their own
+
+// Written in native byte order, at the start of the entry; rows follow at
+// SHEET_CACHE_DATA_OFFSET without padding.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t format;
+    int32_t w;
+    int32_t h;
+    uint64_t data_size;
+    uint64_t source_size;
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+    Hash128 source_hash;
+    uint8_t has_png_key;
+    uint8_t png_key[3];
+    uint8_t padding[4];
+    uint8_t palette[256][4];
+} SheetCacheHeader;
+
+static const char sheet_cache_magic[8] = "SCSHEET";
+
+static bool sheet_cache_key(const char *dir, const char *path, const struct stat *st, const uint8_t *data, size_t size, SheetCacheKey *key) {
+    char *canonical = realpath(path, NULL);
+    if (!canonical) {
+        return false;
+    }
+    const uint64_t version = SHEET_CACHE_VERSION;
+    const Hash128 seed = { 0x13198a2e03707344u, 0xa4093822299f31d0u };
+    Hash128 name = hash_bytes(seed, (const uint8_t *)&version, sizeof(version));
+    name = hash_bytes(name, (const uint8_t *)canonical, strlen(canonical));
+    free(canonical);
+    const int length = snprintf(key->path, sizeof(key->path), "%s/%016" PRIx64 "%016" PRIx64 ".sheet", dir, name.lo, name.hi);
+    if (length <= 0 || (size_t)length >= sizeof(key->path)) {
+        return false;
+    }
+    key->source_size = (uint64_t)st->st_size;
+    key->source_mtime_sec = (int64_t)st->st_mtim.tv_sec;
+    key->source_mtime_nsec = (int64_t)st->st_mtim.tv_nsec;
+    key->source_hash = hash_bytes(seed, data, size);
+    return true;
+}
+
+// Replaces the input file held by sheet with a mapping of its cached decode, if there is a
+// valid one.
+static bool map_cached_sheet(const SheetCacheKey *key, sc_sheet *sheet) {
+    const int fd = open(key->path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    void *mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > SHEET_CACHE_DATA_OFFSET && (uintmax_t)st.st_size <= SIZE_MAX) {
+        mapping = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+
+    const size_t size = (size_t)st.st_size;
+    const SheetCacheHeader *header = (const SheetCacheHeader *)mapping;
+    const SheetFormat format = (SheetFormat)header->format;
+    bool valid = memcmp(header->magic, sheet_cache_magic, sizeof(header->magic)) == 0 &&
+                 header->version == SHEET_CACHE_VERSION &&
+                 header->source_size == key->source_size &&
+                 header->source_mtime_sec == key->source_mtime_sec &&
+                 header->source_mtime_nsec == key->source_mtime_nsec &&
+                 header->source_hash.lo == key->source_hash.lo &&
+                 header->source_hash.hi == key->source_hash.hi &&
+                 header->format <= SHEET_INDEXED && format != SHEET_BGRA &&
+                 header->w > 0 && header->h > 0 && header->w <= (1 << 24) && header->h <= (1 << 24);
+    valid = valid && header->data_size == (uint64_t)header->w * (uint64_t)header->h * (uint64_t)sheet_pixel_size(format) &&
+            header->data_size == size - SHEET_CACHE_DATA_OFFSET;
+    if (!valid) {
+        munmap(mapping, size);
+        return false;
+    }
+
+    release_file_data(sheet);
+    sheet->w = header->w;
+    sheet->h = header->h;
+    sheet->region = (sc_rect){ 0, 0, header->w, header->h };
+    sheet->format = format;
+    sheet->stride = (ptrdiff_t)header->w * sheet_pixel_size(format);
+    sheet->pixels = (const uint8_t *)mapping + SHEET_CACHE_DATA_OFFSET;
+    sheet->has_png_key = header->has_png_key != 0;
+    memcpy(sheet->png_key, header->png_key, sizeof(sheet->png_key));
+    memcpy(sheet->palette, header->palette, sizeof(sheet->palette));
+    sheet->file_data = (uint8_t *)mapping;
+    sheet->file_size = size;
+    sheet->file_mapped = true;
+    return true;
+}
+
+// Writes a fully decoded sheet to the cache under a temporary name and renames it into place,
+// so that other processes only ever map whole entries. Failing to store it only costs the next
+// load.
+static void store_cached_sheet(const SheetCacheKey *key, const sc_sheet *sheet) {
+    const int pixel_size = sheet_pixel_size(sheet->format);
+    if (sheet->format == SHEET_BGRA || sheet->region.x0 != 0 || sheet->region.y0 != 0 ||
+        sheet->region.x1 != sheet->w || sheet->region.y1 != sheet->h) {
+        return;
+    }
+    SheetCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, sheet_cache_magic, sizeof(header.magic));
+    header.version = SHEET_CACHE_VERSION;
+    header.format = (uint32_t)sheet->format;
+    header.w = sheet->w;
+    header.h = sheet->h;
+    header.data_size = (uint64_t)sheet->w * (uint64_t)sheet->h * (uint64_t)pixel_size;
+    header.source_size = key->source_size;
+    header.source_mtime_sec = key->source_mtime_sec;
+    header.source_mtime_nsec = key->source_mtime_nsec;
+    header.source_hash = key->source_hash;
+    header.has_png_key = sheet->has_png_key;
+    memcpy(header.png_key, sheet->png_key, sizeof(header.png_key));
+    memcpy(header.palette, sheet->palette, sizeof(header.palette));
+
+    char temp[PATH_MAX];
+    FILE *f = create_cache_temp(key->path, temp);
+    if (!f) {
+        return;
+    }
+    static const uint8_t zeros[SHEET_CACHE_DATA_OFFSET - sizeof(SheetCacheHeader)];
+    const size_t row_size = (size_t)sheet->w * (size_t)pixel_size;
+    bool written = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(zeros, sizeof(zeros), 1, f) == 1;
+    for (int y = 0; written && y < sheet->h; ++y) {
+        written = fwrite(sheet->pixels + (ptrdiff_t)y * sheet->stride, 1, row_size, f) == row_size;
+    }
+    if (fclose(f) != 0 || !written || rename(temp, key->path) != 0) {
+        unlink(temp);
+    }
+}
+
+// Copies `needed` (all of the sheet if it lies outside) of a sheet that map_direct_sheet() found
+// in file_data into decoded, top row first, and releases file_data.
+static bool copy_direct_region(sc_sheet *sheet, sc_rect needed, const char **reason) {
+    sc_rect region = {
+        needed.x0 > 0 ? needed.x0 : 0,
+        needed.y0 > 0 ? needed.y0 : 0,
+        needed.x1 < sheet->w ? needed.x1 : sheet->w,
+        needed.y1 < sheet->h ? needed.y1 : sheet->h,
+    };
+    if (region.x0 >= region.x1 || region.y0 >= region.y1) {
+        region = (sc_rect){ 0, 0, sheet->w, sheet->h };
+    }
+    const size_t row_size = (size_t)(region.x1 - region.x0) * 4;
+    sheet->decoded = (uint8_t *)malloc(row_size * (size_t)(region.y1 - region.y0));
+    if (!sheet->decoded) {
+        release_file_data(sheet);
+        *reason = "out of memory";
+        return false;
+    }
+    for (int y = region.y0; y < region.y1; ++y) {
+        memcpy(sheet->decoded + (size_t)(y - region.y0) * row_size, sheet->pixels + (ptrdiff_t)y * sheet->stride + (ptrdiff_t)region.x0 * 4, row_size);
+    }
+    release_file_data(sheet);
+    sheet->region = region;
+    sheet->pixels = sheet->decoded;
+    sheet->stride = (ptrdiff_t)row_size;
+    return true;
+}
+
+// Decodes the encoded image held in file_data, decoding no more of it than `needed` (the
+// frames' bounding box) where the format allows, and keeping its own channel count. Formats
+// that store uncompressed 32-bit pixels are used in place when file_data is a mapping of the
+// file, and otherwise just `needed` is copied out of them; 8-bit PNGs are decoded down to the
+// last needed row and only across the needed columns, and anything else is decoded in full.
+// With a cache key, a cached decode is mapped instead if there is one, and otherwise the whole
+// sheet is decoded and stored for the next load. file_data is released unless the pixels live
+// in it. path, when known, lets an image too large for stb_image's memory reader be decoded
+// from the file instead.
+static bool decode_sheet_data(sc_sheet *sheet, sc_rect needed, const char *path, const SheetCacheKey *cache, const char **reason) {
+    if (map_direct_sheet(sheet->file_data, sheet->file_size, sheet)) {
+        return sheet->file_mapped || copy_direct_region(sheet, needed, reason);
+    }
+    if (cache) {
+        if (map_cached_sheet(cache, sheet)) {
+            return true;
+        }
+        needed = whole_sheet;
+    }
+    if (sheet->file_mapped) {
+        posix_madvise(sheet->file_data, sheet->file_size, POSIX_MADV_SEQUENTIAL);
+    }
+    if (decode_png_region(sheet->file_data, sheet->file_size, needed, sheet)) {
+        release_file_data(sheet);
+        if (cache) {
+            store_cached_sheet(cache, sheet);
+        }
+        return true;
+    }
+
+    int channels = 4;
+    const bool too_large = sheet->file_size > INT32_MAX;
+    if (!too_large) {
+        sheet->decoded = stbi_load_from_memory(sheet->file_data, (int)sheet->file_size, &sheet->w, &sheet->h, &channels, 0);
+    } else if (path) {
+        sheet->decoded = stbi_load(path, &sheet->w, &sheet->h, &channels, 0);
+    }
+    release_file_data(sheet);
+    if (too_large && !path) {
+        *reason = "image too large";
+        return false;
+    }
+    if (!finish_full_decode(sheet, channels, reason)) {
+        return false;
+    }
+    if (cache) {
+        store_cached_sheet(cache, sheet);
+    }
+    return true;
+}
+
+// Loads the sheet at path ("-" for stdin); see decode_sheet_data. With file_backed, regular
+// files are mapped rather than read, so the sheet may go on reading from the file; otherwise
+// the file is read into memory and the sheet never touches it again. Regular files go through
+// the decoded-sheet cache in cache_dir unless it is NULL; stdin and pipes are never cached.
+// Returns false with *reason set on failure.
+static bool load_sheet(const char *path, sc_rect needed, const char *cache_dir, bool file_backed, sc_sheet *sheet, const char **reason) {
+    memset(sheet, 0, sizeof(*sheet));
+    FILE *stream = NULL;
+    struct stat st;
+    bool regular = false;
+    if (is_stdio_path(path)) {
+        stream = stdin;
+    } else {
+        int fd = open(path, O_RDONLY);
+        regular = fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && (uintmax_t)st.st_size <= SIZE_MAX;
+        if (regular && file_backed) {
+            void *mapping = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED) {
+                sheet->file_data = (uint8_t *)mapping;
+                sheet->file_size = (size_t)st.st_size;
+                sheet->file_mapped = true;
+            }
+        }
+        if (!sheet->file_data && fd >= 0) {
+            // not mapped, e.g. a pipe
+            stream = fdopen(fd, "rb");
+            fd = stream ? -1 : fd;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (!sheet->file_data && !stream) {
+            // let stb_image report the failure
+            int channels = 4;
+            sheet->decoded = stbi_load(path, &sheet->w, &sheet->h, &channels, 0);
+            return finish_full_decode(sheet, channels, reason);
+        }
+    }
+    if (stream) {
+        sheet->file_data = read_stream(stream, &sheet->file_size);
+        if (stream != stdin) {
+            fclose(stream);
+        }
+        if (!sheet->file_data) {
+            *reason = "read error";
+            return false;
+        }
+    }
+    SheetCacheKey cache;
+    const bool cached = regular && cache_dir && sheet_cache_key(cache_dir, path, &st, sheet->file_data, sheet->file_size, &cache);
+    return decode_sheet_data(sheet, needed, is_stdio_path(path) ? NULL : path, cached ? &cache : NULL, reason);
+}
+
+// Scratch memory owned by one encoding thread and kept by the context between calls, so it is
+// only reallocated when a larger animation comes along. prev/next are only needed when a
+// worker delta-encodes against its neighbours; row holds one converted sheet row. A worker
+// compresses its frames with encoder (the serial path uses the GifWriter's own).
+typedef struct {
+    uint8_t *frame;
+    uint8_t *prev;
+    uint8_t *next;
+    uint8_t *row;
+    GifEncoder encoder;
+    size_t frame_capacity;
+    size_t row_capacity;
+} FrameBuffers;
+
+struct sc_context {
+    int jobs;
+    FrameBuffers *buffers; // one set per encoding thread
+    char *cache_dir;       // encoded frames kept between runs, or NULL
+    bool file_backed;      // sheets may keep reading from their input file
+    char error[256];
+};
+
+// One frame's compressed GIF bytes, handed from a worker to the sequencer.
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    bool done;
+    bool failed;
+} EncodedFrame;
+
+// One frame of the GIF as written. Consecutive repeats of a sheet frame are merged into one
+// GIF frame shown for their combined delay, and a GIF frame that would be encoded exactly like
+// an earlier one (same pixels, drawn over the same frame and disposed the same way) is written
+// from that frame's bytes instead of being encoded again.
+typedef struct {
+    int source;         // index into anim->points of the frame shown
+    uint32_t delay;
+    int disposal;       // kGifDisposeNone when the next frame is drawn over this one
+    int reuse;          // earlier GIF frame whose bytes are written again, or -1
+    bool over_previous; // drawn as a delta over the previous GIF frame
+    bool reused;        // a later frame reuses these bytes, so they are kept to the end
+    Hash128 pixels;     // hash of the frame shown, equal for every frame with its pixels
+} PlannedFrame;
+
+typedef struct {
+    const sc_sheet *sheet;
+    const sc_animation *anim;
+    const Scaler *scaler;
+    const GifGlobalPalette *global_palette;
+    const uint8_t (*index_map)[4]; // sheet palette index -> RGB and GIF index, with keep_palette
+    const PlannedFrame *plan;
+    int plan_count;
+    const char *cache_dir;  // see sc_context_set_cache()
+    Hash128 cache_settings; // everything but the pixels that shapes an encoded frame
+
+    // Workers claim frames in order and may run at most max_in_flight frames ahead of
+    // the sequencer, which bounds the memory held in encoded[].
+    pthread_mutex_t lock;
+    pthread_cond_t frame_encoded;
+    pthread_cond_t frame_written;
+    int next_frame;
+    int frames_written;
+    int max_in_flight;
+    bool aborted;
+    EncodedFrame *encoded; // one per planned frame
+} FramePipeline;
+
+typedef struct {
+    FramePipeline *pipeline;
+    FrameBuffers *buffers;
+} EncodeWorker;
+
+// Records the message sc_context_error() returns and passes status through.
+static sc_status fail(sc_context *ctx, sc_status status, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(ctx->error, sizeof(ctx->error), format, args);
+    va_end(args);
+    return status;
+}
+
+static void free_frame_buffers(FrameBuffers *buffers) {
+    free(buffers->frame);
+    free(buffers->prev);
+    free(buffers->next);
+    free(buffers->row);
+    GifFreeEncoder(&buffers->encoder);
+    memset(buffers, 0, sizeof(*buffers));
+}
+
+static sc_status reserve_frame_buffers(sc_context *ctx, FrameBuffers *buffers, const sc_animation *anim, bool with_neighbours) {
+    const size_t output_size = (size_t)anim->output_w * (size_t)anim->output_h * 4;
+    const size_t row_size = (size_t)anim->frame_w * 4;
+    const bool scaled = anim->output_w != anim->frame_w || anim->output_h != anim->frame_h;
+    if (output_size > buffers->frame_capacity) {
+        free(buffers->frame);
+        free(buffers->prev);
+        free(buffers->next);
+        buffers->frame = buffers->prev = buffers->next = NULL;
+        buffers->frame_capacity = output_size;
+    }
+    if (row_size > buffers->row_capacity) {
+        free(buffers->row);
+        buffers->row = NULL;
+        buffers->row_capacity = row_size;
+    }
+
+    if (!buffers->frame) {
+        buffers->frame = (uint8_t *)malloc(buffers->frame_capacity);
+        if (!buffers->frame) {
+            return fail(ctx, SC_ERROR_OUT_OF_MEMORY, "Memory allocation failed for %s buffer", scaled ? "scaled" : "frame");
+        }
+    }
+    if (with_neighbours && !buffers->prev) {
+        buffers->prev = (uint8_t *)malloc(buffers->frame_capacity);
+    }
+    if (with_neighbours && !buffers->next) {
+        buffers->next = (uint8_t *)malloc(buffers->frame_capacity);
+    }
+    if (!buffers->row) {
+        buffers->row = (uint8_t *)malloc(buffers->row_capacity);
+    }
+    if ((with_neighbours && (!buffers->prev || !buffers->next)) || !buffers->row) {
+        return fail(ctx, SC_ERROR_OUT_OF_MEMORY, "Memory allocation failed for frame buffer");
+    }
+    return SC_OK;
+}
+
+// Makes anim's -t color, or black without one, the color of palette entry 0 (the transparency
+// index) in everything encoded with encoder.
+static void set_transparent_color(GifEncoder *encoder, const sc_animation *anim) {
+    if (anim->transparency_color_set) {
+        GifSetTransparentColor(encoder, anim->transparency_r, anim->transparency_g, anim->transparency_b);
+    } else {
+        GifSetTransparentColor(encoder, 0, 0, 0);
+    }
+}
+
+// Whether frames need keying with the animation's transparency color, i.e. it has one and it
+// was not already applied to the whole sheet.
+static bool needs_keying(const sc_sheet *sheet, const sc_animation *anim) {
+    return anim->transparency_color_set &&
+           !(sheet->keyed && sheet->key[0] == anim->transparency_r && sheet->key[1] == anim->transparency_g && sheet->key[2] == anim->transparency_b);
+}
+
+// Looks up `count` palette indices of an indexed sheet starting at (x, y) in map, writing
+// the color and GIF index of each to scratch.
+static const uint8_t *map_sheet_row(const sc_sheet *sheet, const uint8_t (*map)[4], int x, int y, int count, uint8_t *scratch) {
+    const uint8_t *src = sheet->pixels + (ptrdiff_t)(y - sheet->region.y0) * sheet->stride + (x - sheet->region.x0);
+    for (int i = 0; i < count; ++i) {
+        memcpy(scratch + i * 4, map[src[i]], 4);
+    }
+    return scratch;
+}
+
+// Crops, scales and color-keys one frame into dst in a single pass over the sheet: each
+// distinct source row is read straight from the sheet, scaled and keyed once, and destination
+// rows that repeat it are copied from the row above. Origins must already be bounds-checked.
+// scratch holds one source row of a sheet that is not stored as RGBA.
+static void extract_frame(const FramePipeline *p, int index, uint8_t *dst, uint8_t *scratch) {
+    const sc_animation *anim = p->anim;
+    const Scaler *scaler = p->scaler;
+    const sc_point origin = anim->points[index];
+    const size_t dst_stride = (size_t)scaler->dst_w * 4;
+    const bool key = needs_keying(p->sheet, anim);
+
+    for (int y = 0; y < scaler->dst_h; ++y) {
+        uint8_t *dst_row = dst + (size_t)y * dst_stride;
+        if (y > 0 && scaler->src_y[y] == scaler->src_y[y - 1]) {
+            memcpy(dst_row, dst_row - dst_stride, dst_stride);
+            continue;
+        }
+        if (p->index_map) {
+            // keying is already part of the map
+            scale_row(scaler, map_sheet_row(p->sheet, p->index_map, origin.x, origin.y + scaler->src_y[y], scaler->src_w, scratch), dst_row);
+            continue;
+        }
+        const uint8_t *src_row = sheet_row(p->sheet, origin.x, origin.y + scaler->src_y[y], scaler->src_w, scratch);
+        scale_row(scaler, src_row, dst_row);
+        if (key) {
+            apply_transparency_color(dst_row, (size_t)scaler->dst_w, anim->transparency_r, anim->transparency_g, anim->transparency_b);
+        }
+    }
+}
+
+// Copies the opaque pixels of the unscaled frame at origin to the front of dst (room for one
+// frame) and returns how many there are.
+static size_t gather_opaque_pixels(const sc_sheet *sheet, const sc_animation *anim, sc_point origin, uint8_t *dst) {
+    const bool key = needs_keying(sheet, anim);
+    size_t count = 0;
+    for (int y = 0; y < anim->frame_h; ++y) {
+        uint8_t *row = dst + count * 4;
+        const uint8_t *src = sheet_row(sheet, origin.x, origin.y + y, anim->frame_w, row);
+        if (src != row) {
+            memcpy(row, src, (size_t)anim->frame_w * 4);
+        }
+        if (key) {
+            apply_transparency_color(row, (size_t)anim->frame_w, anim->transparency_r, anim->transparency_g, anim->transparency_b);
+        }
+        // Keep only opaque pixels; the write position never passes the read position.
+        for (int x = 0; x < anim->frame_w; ++x) {
+            if (row[x * 4 + 3] != 0) {
+                memmove(dst + count * 4, row + x * 4, 4);
+                ++count;
+            }
+        }
+    }
+    return count;
+}
+
+// Whether frame i repeats the coordinates of an earlier frame.
+static bool repeats_earlier_frame(const sc_animation *anim, int i) {
+    for (int j = 0; j < i; ++j) {
+        if (anim->points[j].x == anim->points[i].x && anim->points[j].y == anim->points[i].y) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reduces the opaque pixels of every distinct frame to one palette. The unscaled crops are
+// enough: nearest-neighbour scaling only repeats their pixels. Frames are extracted one at a
+// time into a single scratch frame and their colors added to an exact palette as they come;
+// only if that overflows are the distinct frames' pixels collected for a median split, which
+// weighs each color by how many pixels use it.
+static bool build_global_palette(const GifEncoder *settings, const sc_sheet *sheet, const sc_animation *anim, GifGlobalPalette *global) {
+    const size_t frame_pixels = (size_t)anim->frame_w * (size_t)anim->frame_h;
+    if (frame_pixels > INT32_MAX) {
+        return false;
+    }
+    uint8_t *frame = (uint8_t *)malloc(frame_pixels * 4);
+    if (!frame) {
+        return false;
+    }
+
+    GifBeginExactPalette(global);
+    bool exact = true;
+    for (int i = 0; i < anim->frame_count && exact; ++i) {
+        if (!repeats_earlier_frame(anim, i)) {
+            const size_t count = gather_opaque_pixels(sheet, anim, anim->points[i], frame);
+            exact = GifAddExactColors(frame, (uint32_t)count, 8, global);
+        }
+    }
+    if (exact) {
+        GifEndExactPalette(settings, global);
+        free(frame);
+        return true;
+    }
+
+    uint8_t *pixels = NULL;
+    size_t total = 0;
+    bool ok = true;
+    for (int i = 0; i < anim->frame_count && ok; ++i) {
+        if (repeats_earlier_frame(anim, i)) {
+            continue;
+        }
+        const size_t count = gather_opaque_pixels(sheet, anim, anim->points[i], frame);
+        if (count == 0) {
+            continue;
+        }
+        uint8_t *grown = total + count <= INT32_MAX ? (uint8_t *)realloc(pixels, (total + count) * 4) : NULL;
+        ok = grown != NULL;
+        if (ok) {
+            pixels = grown;
+            memcpy(pixels + total * 4, frame, count * 4);
+            total += count;
+        }
+    }
+    free(frame);
+    if (ok) {
+        GifMakeGlobalPalette(settings, pixels, (uint32_t)total, 8, false, global);
+    }
+    free(pixels);
+    return ok;
+}
+
+// Maps the palette entries an indexed sheet's frames use straight onto a global palette, so
+// frames come out of extract_frame already palettized (see GifCopyIndexedImage). Entries
+// that are transparent or match the -t color map to the transparency index, and entries with
+// the same color share one index. Returns false if the frames use more than 255 colors.
+static bool build_indexed_palette(const GifEncoder *settings, const sc_sheet *sheet, const sc_animation *anim, GifGlobalPalette *global, uint8_t map[256][4]) {
+    bool used[256] = { false };
+    for (int i = 0; i < anim->frame_count; ++i) {
+        const sc_point origin = anim->points[i];
+        for (int y = 0; y < anim->frame_h; ++y) {
+            const uint8_t *src = sheet->pixels + (ptrdiff_t)(origin.y + y - sheet->region.y0) * sheet->stride + (origin.x - sheet->region.x0);
+            for (int x = 0; x < anim->frame_w; ++x) {
+                used[src[x]] = true;
+            }
+        }
+    }
+
+    memset(global, 0, sizeof(*global));
+    GifClearColorCache(&global->cache);
+    GifPalette *pal = &global->pal;
+    pal->r[kGifTransIndex] = settings->transRed;
+    pal->g[kGifTransIndex] = settings->transGreen;
+    pal->b[kGifTransIndex] = settings->transBlue;
+    int count = 0;
+    for (int i = 0; i < 256; ++i) {
+        const uint8_t *color = sheet->palette[i];
+        map[i][0] = color[0];
+        map[i][1] = color[1];
+        map[i][2] = color[2];
+        map[i][3] = kGifTransIndex;
+        const bool keyed = anim->transparency_color_set && color[0] == anim->transparency_r &&
+                           color[1] == anim->transparency_g && color[2] == anim->transparency_b;
+        if (!used[i] || color[3] == 0 || keyed) {
+            continue;
+        }
+        int index = 1;
+        while (index <= count && (pal->r[index] != color[0] || pal->g[index] != color[1] || pal->b[index] != color[2])) {
+            ++index;
+        }
+        if (index > count) {
+            if (count == 255) {
+                return false;
+            }
+            index = ++count;
+            pal->r[index] = color[0];
+            pal->g[index] = color[1];
+            pal->b[index] = color[2];
+        }
+        map[i][3] = (uint8_t)index;
+    }
+
+    // GIF's minimum LZW code size is 2 bits
+    pal->bitDepth = 2;
+    while ((1 << pal->bitDepth) < count + 1) {
+        ++pal->bitDepth;
+    }
+    global->exact = true;
+    global->indexed = true;
+    return true;
+}
+
+// Hashes an extracted frame; frames with equal hashes are compared in full before being
+// treated as equal, except by the frame cache, which trusts all 128 bits.
+static Hash128 hash_frame(const uint8_t *pixels, size_t size) {
+    const Hash128 seed = { 0x9e3779b97f4a7c15u ^ size, 0x243f6a8885a308d3u + size };
+    return hash_bytes(seed, pixels, size);
+}
+
+static bool same_hash(Hash128 a, Hash128 b) {
+    return a.lo == b.lo && a.hi == b.hi;
+}
+
+// Works out the GIF frames of p->anim (see PlannedFrame). Each sheet frame is extracted once to
+// find the ones with identical pixels and, with delta encoding, which GIF frames can stay on the
+// canvas under the next; without delta encoding, coordinates already seen are not extracted
+// again. buffers must have room for neighbouring frames.
+static sc_status plan_frames(sc_context *ctx, FramePipeline *p, FrameBuffers *buffers, PlannedFrame **plan_out, int *count_out) {
+    const sc_animation *anim = p->anim;
+    const int n = anim->frame_count;
+    const size_t frame_size = (size_t)anim->output_w * (size_t)anim->output_h * 4;
+    const uint32_t num_pixels = (uint32_t)anim->output_w * (uint32_t)anim->output_h;
+    int *group = (int *)malloc(sizeof(int) * (size_t)n); // first sheet frame with the same pixels
+    Hash128 *hashes = (Hash128 *)malloc(sizeof(Hash128) * (size_t)n);
+    PlannedFrame *plan = (PlannedFrame *)calloc((size_t)n, sizeof(PlannedFrame));
+    if (!group || !hashes || !plan) {
+        free(plan);
+        free(hashes);
+        free(group);
+        return fail(ctx, SC_ERROR_OUT_OF_MEMORY, "Memory allocation failed for frame buffer");
+    }
+
+    uint8_t *cur = buffers->frame;
+    uint8_t *prev = buffers->prev;
+    int count = 0;
+    for (int i = 0; i < n; ++i) {
+        const sc_point origin = anim->points[i];
+        group[i] = -1;
+        for (int j = 0; j < i && group[i] < 0; ++j) {
+            if (anim->points[j].x == origin.x && anim->points[j].y == origin.y) {
+                group[i] = group[j];
+            }
+        }
+        const bool extract = group[i] < 0 || anim->delta;
+        if (extract) {
+            extract_frame(p, i, cur, buffers->row);
+        }
+        if (group[i] < 0) {
+            group[i] = i;
+            hashes[i] = hash_frame(cur, frame_size);
+            for (int j = 0; j < i; ++j) {
+                if (group[j] != j || !same_hash(hashes[j], hashes[i])) {
+                    continue;
+                }
+                extract_frame(p, j, buffers->next, buffers->row);
+                if (memcmp(cur, buffers->next, frame_size) == 0) {
+                    group[i] = j;
+                    break;
+                }
+            }
+        }
+
+        PlannedFrame *last = count > 0 ? &plan[count - 1] : NULL;
+        if (last && group[last->source] == group[i] && (uint64_t)last->delay + anim->delay_cs <= UINT16_MAX) {
+            last->delay += anim->delay_cs;
+        } else {
+            if (last && anim->delta && !GifNeedsClear(prev, cur, num_pixels)) {
+                last->disposal = kGifDisposeNone;
+            }
+            plan[count++] = (PlannedFrame){ .source = i, .delay = anim->delay_cs, .disposal = kGifDisposeBackground, .reuse = -1, .pixels = hashes[group[i]] };
+        }
+        if (extract) {
+            uint8_t *swap = prev;
+            prev = cur;
+            cur = swap;
+        }
+    }
+    if (anim->delta) {
+        // the animation loops, so the last frame is followed by the first
+        extract_frame(p, 0, cur, buffers->row);
+        if (!GifNeedsClear(prev, cur, num_pixels)) {
+            plan[count - 1].disposal = kGifDisposeNone;
+        }
+    }
+
+    for (int k = 0; k < count; ++k) {
+        PlannedFrame *frame = &plan[k];
+        frame->over_previous = k > 0 && plan[k - 1].disposal == kGifDisposeNone;
+        for (int j = 0; j < k; ++j) {
+            const PlannedFrame *earlier = &plan[j];
+            if (earlier->reuse >= 0 || group[earlier->source] != group[frame->source] ||
+                earlier->disposal != frame->disposal || earlier->over_previous != frame->over_previous) {
+                continue;
+            }
+            if (frame->over_previous && group[plan[j - 1].source] != group[plan[k - 1].source]) {
+                continue;
+            }
+            frame->reuse = j;
+            plan[j].reused = true;
+            break;
+        }
+    }
+
+    free(hashes);
+    free(group);
+    *plan_out = plan;
+    *count_out = count;
+    return SC_OK;
+}
+
+// Bumped whenever the encoder changes the bytes it produces, which invalidates every frame
+// cached so far.
+#define FRAME_CACHE_VERSION 2
+
+// Hashes everything except a frame's pixels that decides how it is encoded. The delay is left
+// out: it is patched into a cached frame, so frames differing only in delay share an entry.
+static Hash128 hash_encoding_settings(const sc_animation *anim, const GifEncoder *settings, const GifGlobalPalette *global) {
+    const uint64_t words[4] = {
+        FRAME_CACHE_VERSION,
+        8, // bit depth
+        (uint64_t)anim->output_w << 32 | (uint32_t)anim->output_h,
+        (uint64_t)settings->transRed << 16 | (uint64_t)settings->transGreen << 8 | settings->transBlue,
+    };
+    const Hash128 seed = { 0x452821e638d01377u, 0xbe5466cf34e90c6cu };
+    Hash128 hash = hash_bytes(seed, (const uint8_t *)words, sizeof(words));
+    if (global) {
+        const uint8_t flags[2] = { global->exact, global->indexed };
+        hash = hash_bytes(hash, (const uint8_t *)&global->pal, sizeof(global->pal));
+        hash = hash_bytes(hash, flags, sizeof(flags));
+    }
+    return hash;
+}
+
+// The key of a cached frame, written in native byte order at the start of its entry ahead of
+// the frame's bytes, and compared in full on load so that an entry under the wrong name, or
+// left over from another version, is never used.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t disposal;
+    Hash128 settings; // see hash_encoding_settings
+    Hash128 pixels;
+    Hash128 under; // pixels of the frame it is drawn over as a delta, or zero
+} FrameCacheKey;
+
+static const char frame_cache_magic[8] = "SCFRAME";
+
+// Fills in the key of planned frame k: its pixels, those of the frame it is drawn over as a
+// delta, its disposal and the animation's encoding settings.
+static void frame_cache_key(const FramePipeline *p, int k, FrameCacheKey *key) {
+    const PlannedFrame *frame = &p->plan[k];
+    memset(key, 0, sizeof(*key));
+    memcpy(key->magic, frame_cache_magic, sizeof(key->magic));
+    key->version = FRAME_CACHE_VERSION;
+    key->disposal = (uint32_t)frame->disposal;
+    key->settings = p->cache_settings;
+    key->pixels = frame->pixels;
+    if (frame->over_previous) {
+        key->under = p->plan[k - 1].pixels;
+    }
+}
+
+// Names the cache entry for key. Returns false if the name does not fit in path.
+static bool frame_cache_path(const char *dir, const FrameCacheKey *key, char *path, size_t size) {
+    const Hash128 seed = { 0x452821e638d01377u, 0xbe5466cf34e90c6cu };
+    const Hash128 name = hash_bytes(seed, (const uint8_t *)key, sizeof(*key));
+    const int length = snprintf(path, size, "%s/%016" PRIx64 "%016" PRIx64 ".gifframe", dir, name.lo, name.hi);
+    return length > 0 && (size_t)length < size;
+}
+
+// Checks that data is exactly one encoded frame as GifEncodeFrame() writes it: a graphics
+// control extension, an image descriptor with an optional local color table, and LZW data
+// sub-blocks up to the terminating empty one at the very end.
+static bool is_encoded_frame(const uint8_t *data, size_t size) {
+    if (size < 19 || data[0] != 0x21 || data[1] != 0xf9 || data[2] != 4 || data[7] != 0 || data[8] != 0x2c) {
+        return false;
+    }
+    size_t pos = 18;
+    if (data[17] & 0x80) {
+        pos += (size_t)3 << ((data[17] & 7) + 1);
+    }
+    ++pos; // LZW minimum code size
+    while (pos < size && data[pos] != 0) {
+        pos += (size_t)data[pos] + 1;
+    }
+    return pos == size - 1;
+}
+
+// Reads a cached frame, rejecting anything but an entry with exactly this key followed by one
+// whole encoded frame.
+static bool load_cached_frame(const char *path, const FrameCacheKey *key, EncodedFrame *frame) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return false;
+    }
+    size_t size;
+    uint8_t *data = read_stream(f, &size);
+    fclose(f);
+    if (!data || size < sizeof(*key) || memcmp(data, key, sizeof(*key)) != 0 ||
+        !is_encoded_frame(data + sizeof(*key), size - sizeof(*key))) {
+        free(data);
+        return false;
+    }
+    size -= sizeof(*key);
+    memmove(data, data + sizeof(*key), size);
+    frame->data = data;
+    frame->size = size;
+    return true;
+}
+
+// Stores an encoded frame after its key under a temporary name and renames it into place, so
+// that readers in other processes never see part of an entry. Failing to store it only costs
+// the next run.
+static void store_cached_frame(const char *path, const FrameCacheKey *key, const uint8_t *data, size_t size) {
+    char temp[PATH_MAX];
+    FILE *f = create_cache_temp(path, temp);
+    if (!f) {
+        return;
+    }
+    const bool written = fwrite(key, sizeof(*key), 1, f) == 1 && fwrite(data, 1, size, f) == size;
+    if (fclose(f) != 0 || !written || rename(temp, path) != 0) {
+        unlink(temp);
+    }
+}
+
+// Palettizes and compresses planned frame k, unless it reuses an earlier frame's bytes or
+// they are found in the frame cache.
+static EncodedFrame encode_planned_frame(const FramePipeline *p, int k, FrameBuffers *buffers) {
+    const PlannedFrame *frame = &p->plan[k];
+    EncodedFrame result = { .done = true };
+    if (frame->reuse >= 0) {
+        return result;
+    }
+    FrameCacheKey cache_key;
+    char cache_path[PATH_MAX];
+    if (p->cache_dir) {
+        frame_cache_key(p, k, &cache_key);
+    }
+    const bool cached = p->cache_dir && frame_cache_path(p->cache_dir, &cache_key, cache_path, sizeof(cache_path));
+    if (cached && load_cached_frame(cache_path, &cache_key, &result)) {
+        GifSetEncodedFrameDelay(result.data, frame->delay);
+        return result;
+    }
+
+    const sc_animation *anim = p->anim;
+    extract_frame(p, frame->source, buffers->frame, buffers->row);
+    const uint8_t *prev = NULL;
+    if (frame->over_previous) {
+        extract_frame(p, p->plan[k - 1].source, buffers->prev, buffers->row);
+        prev = buffers->prev;
+    }
+
+    GifBuffer out;
+    GifInitBuffer(&out, NULL, NULL);
+    GifEncodeFrame(&buffers->encoder, &out, prev, buffers->frame, (uint32_t)anim->output_w, (uint32_t)anim->output_h, frame->delay, frame->disposal, 8, false, p->global_palette);
+    if (out.failed) {
+        GifFreeBuffer(&out);
+    } else if (cached) {
+        store_cached_frame(cache_path, &cache_key, out.data, out.size);
+    }
+    result.data = out.data;
+    result.size = out.size;
+    result.failed = out.failed;
+    return result;
+}
+
+// Appends planned frame k to the GIF from its own bytes or those of the frame it reuses. Only
+// the sequencer calls this, after every earlier frame has been written.
+static bool write_planned_frame(FramePipeline *p, GifWriter *writer, int k) {
+    const PlannedFrame *frame = &p->plan[k];
+    EncodedFrame *encoded = &p->encoded[frame->reuse >= 0 ? frame->reuse : k];
+    if (encoded->failed) {
+        return false;
+    }
+    if (frame->reuse >= 0) {
+        GifSetEncodedFrameDelay(encoded->data, frame->delay);
+    }
+    return GifWriteEncodedFrame(writer, encoded->data, encoded->size);
+}
+
+static void *encode_worker(void *arg) {
+    EncodeWorker *worker = (EncodeWorker *)arg;
+    FramePipeline *p = worker->pipeline;
+
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        while (!p->aborted && p->next_frame < p->plan_count && p->next_frame >= p->frames_written + p->max_in_flight) {
+            pthread_cond_wait(&p->frame_written, &p->lock);
+        }
+        if (p->aborted || p->next_frame >= p->plan_count) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        const int index = p->next_frame++;
+        pthread_mutex_unlock(&p->lock);
+
+        EncodedFrame result = encode_planned_frame(p, index, worker->buffers);
+
+        pthread_mutex_lock(&p->lock);
+        p->encoded[index] = result;
+        pthread_cond_broadcast(&p->frame_encoded);
+        pthread_mutex_unlock(&p->lock);
+    }
+    return NULL;
+}
+
+static sc_status write_frames_serial(sc_context *ctx, FramePipeline *p, GifWriter *writer) {
+    set_transparent_color(&ctx->buffers[0].encoder, p->anim);
+    for (int k = 0; k < p->plan_count; ++k) {
+        p->encoded[k] = encode_planned_frame(p, k, &ctx->buffers[0]);
+        const bool written = write_planned_frame(p, writer, k);
+        if (!p->plan[k].reused) {
+            free(p->encoded[k].data);
+            p->encoded[k].data = NULL;
+        }
+        if (!written) {
+            return fail(ctx, SC_ERROR_WRITE_FAILED, "Failed to write frame %d", p->plan[k].source + 1);
+        }
+    }
+    return SC_OK;
+}
+
+// Encodes frames on `jobs` worker threads while the calling thread acts as the sequencer,
+// appending each frame's bytes to the GIF strictly in planned order.
+static sc_status write_frames_parallel(sc_context *ctx, FramePipeline *p, GifWriter *writer, int jobs) {
+    EncodeWorker *workers = (EncodeWorker *)calloc((size_t)jobs, sizeof(EncodeWorker));
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * (size_t)jobs);
+    if (!workers || !threads) {
+        free(threads);
+        free(workers);
+        return fail(ctx, SC_ERROR_OUT_OF_MEMORY, "Memory allocation failed for frame buffer");
+    }
+
+    sc_status status = SC_OK;
+    for (int t = 0; t < jobs && status == SC_OK; ++t) {
+        workers[t].pipeline = p;
+        workers[t].buffers = &ctx->buffers[t];
+        status = reserve_frame_buffers(ctx, workers[t].buffers, p->anim, p->anim->delta);
+        set_transparent_color(&workers[t].buffers->encoder, p->anim);
+    }
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->frame_encoded, NULL);
+    pthread_cond_init(&p->frame_written, NULL);
+    p->next_frame = 0;
+    p->frames_written = 0;
+    p->max_in_flight = jobs * 2;
+    p->aborted = false;
+
+    int threads_started = 0;
+    if (status == SC_OK) {
+        for (; threads_started < jobs; ++threads_started) {
+            if (pthread_create(&threads[threads_started], NULL, encode_worker, &workers[threads_started]) != 0) {
+                break;
+            }
+        }
+        if (threads_started == 0) {
+            status = fail(ctx, SC_ERROR_THREAD_FAILED, "Failed to start encoding threads");
+        }
+    }
+
+    for (int i = 0; status == SC_OK && i < p->plan_count; ++i) {
+        pthread_mutex_lock(&p->lock);
+        while (!p->encoded[i].done) {
+            pthread_cond_wait(&p->frame_encoded, &p->lock);
+        }
+        pthread_mutex_unlock(&p->lock);
+
+        // Nothing else touches a frame once it is done, nor the earlier frame it may reuse.
+        if (!write_planned_frame(p, writer, i)) {
+            status = fail(ctx, SC_ERROR_WRITE_FAILED, "Failed to write frame %d", p->plan[i].source + 1);
+        }
+
+        pthread_mutex_lock(&p->lock);
+        if (!p->plan[i].reused) {
+            free(p->encoded[i].data);
+            p->encoded[i].data = NULL;
+        }
+        ++p->frames_written;
+        if (status != SC_OK) {
+            p->aborted = true;
+        }
+        pthread_cond_broadcast(&p->frame_written);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    for (int t = 0; t < threads_started; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+
+    pthread_cond_destroy(&p->frame_written);
+    pthread_cond_destroy(&p->frame_encoded);
+    pthread_mutex_destroy(&p->lock);
+    free(threads);
+    free(workers);
+    return status;
+}
+
+sc_context *sc_context_create(int jobs) {
+    if (jobs <= 0) {
+        const long online = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = online > 0 ? (int)online : 1;
+    }
+    sc_context *ctx = (sc_context *)calloc(1, sizeof(sc_context));
+    if (!ctx) {
+        return NULL;
+    }
+    ctx->buffers = (FrameBuffers *)calloc((size_t)jobs, sizeof(FrameBuffers));
+    if (!ctx->buffers) {
+        free(ctx);
+        return NULL;
+    }
+    for (int t = 0; t < jobs; ++t) {
+        GifInitEncoder(&ctx->buffers[t].encoder);
+    }
+    ctx->jobs = jobs;
+    return ctx;
+}
+
+void sc_context_destroy(sc_context *ctx) {
+    if (!ctx) {
+        return;
+    }
+    for (int t = 0; t < ctx->jobs; ++t) {
+        free_frame_buffers(&ctx->buffers[t]);
+    }
+    free(ctx->buffers);
+    free(ctx->cache_dir);
+    free(ctx);
+}
+
+const char *sc_context_error(const sc_context *ctx) {
+    return ctx->error;
+}
+
+sc_status sc_context_set_cache(sc_context *ctx, const char *dir) {
+    ctx->error[0] = '\0';
+    free(ctx->cache_dir);
+    ctx->cache_dir = NULL;
+    if (!dir) {
+        return SC_OK;
+    }
+    struct stat st;
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        return fail(ctx, SC_ERROR_CACHE_FAILED, "Cannot create cache directory '%s': %s", dir, strerror(errno));
+    }
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return fail(ctx, SC_ERROR_CACHE_FAILED, "Cache path '%s' is not a directory", dir);
+    }
+    ctx->cache_dir = strdup(dir);
+    if (!ctx->cache_dir) {
+        return fail(ctx, SC_ERROR_OUT_OF_MEMORY, "Memory allocation failed for cache directory");
+    }
+    return SC_OK;
+}
+
+void sc_context_set_file_backed(sc_context *ctx, bool file_backed) {
+    ctx->file_backed = file_backed;
+}
+
+sc_status sc_sheet_load(sc_context *ctx, const char *path, const sc_rect *region, sc_sheet **sheet) {
+    ctx->error[0] = '\0';
+    *sheet = NULL;
+    if (!path) {
+        return fail(ctx, SC_ERROR_INVALID_ARGUMENT, "No image path given");
+    }
+    sc_sheet *loaded = (sc_sheet *)malloc(sizeof(sc_sheet));
+    if (!loaded) {
+        return fail(ctx, SC_ERROR_OUT_OF_MEMORY, "Memory allocation failed for sheet");
+    }
+    const char *reason = NULL;
+    if (!load_sheet(path, region ? *region : whole_sheet, ctx->cache_dir, ctx->file_backed, loaded, &reason)) {
+        free_sheet(loaded);
+        free(loaded);
+        return fail(ctx, SC_ERROR_LOAD_FAILED, "%s", reason);
+    }
+    *sheet = loaded;
+    return SC_OK;
+}
+
+sc_status sc_sheet_load_memory(sc_context *ctx, const uint8_t *data, size_t size, const sc_rect *region, sc_sheet **sheet) {
+    ctx->error[0] = '\0';
+    *sheet = NULL;
+    if (!data || size == 0) {
+        return fail(ctx, SC_ERROR_INVALID_ARGUMENT, "No image data given");
+    }
+    sc_sheet *loaded = (sc_sheet *)calloc(1, sizeof(sc_sheet));
+    if (loaded) {
+        loaded->file_data = (uint8_t *)malloc(size);
+    }
+    if (!loaded || !loaded->file_data) {
+        free(loaded);
+        return fail(ctx, SC_ERROR_OUT_OF_MEMORY, "Memory allocation failed for sheet");
+    }
+    memcpy(loaded->file_data, data, size);
+    loaded->file_size = size;
+
+    const char *reason = NULL;
+    if (!decode_sheet_data(loaded, region ? *region : whole_sheet, NULL, NULL, &reason)) {
+        free_sheet(loaded);
+        free(loaded);
+        return fail(ctx, SC_ERROR_LOAD_FAILED, "%s", reason);
+    }
+    *sheet = loaded;
+    return SC_OK;
+}
+
+void sc_sheet_free(sc_sheet *sheet) {
+    if (sheet) {
+        free_sheet(sheet);
+        free(sheet);
+    }
+}
+
+void sc_sheet_size(const sc_sheet *sheet, int *w, int *h) {
+    *w = sheet->w;
+    *h = sheet->h;
+}
+
+size_t sc_sheet_memory(const sc_sheet *sheet) {
+    size_t memory = sizeof(*sheet) + sheet->file_size;
+    if (sheet->decoded) {
+        const size_t region_pixels = (size_t)(sheet->region.x1 - sheet->region.x0) * (size_t)(sheet->region.y1 - sheet->region.y0);
+        memory += region_pixels * (size_t)sheet_pixel_size(sheet->format);
+    }
+    return memory;
+}
+
+bool sc_sheet_apply_key(sc_sheet *sheet, uint8_t r, uint8_t g, uint8_t b) {
+    // A TGA/BMP sheet kept as stored is left untouched, and other formats have no alpha to
+    // clear.
+    if (!sheet->decoded || sheet->format != SHEET_RGBA || sheet->keyed) {
+        return false;
+    }
+    const size_t region_pixels = (size_t)(sheet->region.x1 - sheet->region.x0) * (size_t)(sheet->region.y1 - sheet->region.y0);
+    apply_transparency_color(sheet->decoded, region_pixels, r, g, b);
+    sheet->keyed = true;
+    sheet->key[0] = r;
+    sheet->key[1] = g;
+    sheet->key[2] = b;
+    return true;
+}
+
+// Side of the square tiles sc_sheet_diff() compares; dirty rectangles are made of whole tiles.
+#define DIFF_TILE 32
+
+static bool rect_contains(sc_rect outer, sc_rect inner) {
+    return inner.x0 >= outer.x0 && inner.y0 >= outer.y0 && inner.x1 <= outer.x1 && inner.y1 <= outer.y1;
+}
+
+sc_status sc_sheet_diff(sc_context *ctx, const sc_sheet *a, const sc_sheet *b, sc_rect region, sc_rect *dirty, int max_dirty, int *dirty_count) {
+    ctx->error[0] = '\0';
+    *dirty_count = 0;
+    if (max_dirty < 1) {
+        return fail(ctx, SC_ERROR_INVALID_ARGUMENT, "No room for dirty rectangles");
+    }
+    region.x0 = region.x0 > 0 ? region.x0 : 0;
+    region.y0 = region.y0 > 0 ? region.y0 : 0;
+    region.x1 = region.x1 < a->w ? region.x1 : a->w;
+    region.y1 = region.y1 < a->h ? region.y1 : a->h;
+    if (region.x0 >= region.x1 || region.y0 >= region.y1) {
+        return SC_OK;
+    }
+    // Pixels that cannot be compared count as changed, and so does everything when an indexed
+    // sheet's palette changes, since --keep-palette writes its indices as they are.
+    const bool indexed = a->format == SHEET_INDEXED || b->format == SHEET_INDEXED;
+    if (a->w != b->w || a->h != b->h || !rect_contains(a->region, region) || !rect_contains(b->region, region) ||
+        (indexed && (a->format != b->format || memcmp(a->palette, b->palette, sizeof(a->palette)) != 0))) {
+        dirty[0] = region;
+        *dirty_count = 1;
+        return SC_OK;
+    }
+
+    const int width = region.x1 - region.x0;
+    const int columns = (width + DIFF_TILE - 1) / DIFF_TILE;
+    uint8_t *scratch_a = (uint8_t *)malloc((size_t)width * 4);
+    uint8_t *scratch_b = (uint8_t *)malloc((size_t)width * 4);
+    bool *changed = (bool *)malloc((size_t)columns);
+    if (!scratch_a || !scratch_b || !changed) {
+        free(changed);
+        free(scratch_b);
+        free(scratch_a);
+        return fail(ctx, SC_ERROR_OUT_OF_MEMORY, "Memory allocation failed for sheet comparison");
+    }
+
+    // Runs of changed tiles in each band of tile rows become rectangles, which grow downwards
+    // while the band below changes over the same columns. When they do not all fit in dirty,
+    // their bounding box is reported instead.
+    sc_rect bounds = { INT_MAX, INT_MAX, 0, 0 };
+    int count = 0;
+    bool overflow = false;
+    for (int top = region.y0; top < region.y1; top += DIFF_TILE) {
+        const int bottom = top + DIFF_TILE < region.y1 ? top + DIFF_TILE : region.y1;
+        memset(changed, 0, (size_t)columns);
+        for (int y = top; y < bottom; ++y) {
+            const uint8_t *row_a = sheet_row(a, region.x0, y, width, scratch_a);
+            const uint8_t *row_b = sheet_row(b, region.x0, y, width, scratch_b);
+            for (int c = 0; c < columns; ++c) {
+                const int x = c * DIFF_TILE;
+                const int span = x + DIFF_TILE < width ? DIFF_TILE : width - x;
+                changed[c] = changed[c] || memcmp(row_a + (size_t)x * 4, row_b + (size_t)x * 4, (size_t)span * 4) != 0;
+            }
+        }
+
+        const int band_start = count;
+        for (int c = 0; c < columns;) {
+            if (!changed[c]) {
+                ++c;
+                continue;
+            }
+            const int first = c;
+            while (c < columns && changed[c]) {
+                ++c;
+            }
+            const sc_rect run = { region.x0 + first * DIFF_TILE, top, region.x0 + c * DIFF_TILE < region.x1 ? region.x0 + c * DIFF_TILE : region.x1, bottom };
+            bounds.x0 = run.x0 < bounds.x0 ? run.x0 : bounds.x0;
+            bounds.y0 = run.y0 < bounds.y0 ? run.y0 : bounds.y0;
+            bounds.x1 = run.x1 > bounds.x1 ? run.x1 : bounds.x1;
+            bounds.y1 = run.y1;
+            if (overflow) {
+                continue;
+            }
+            int merged = -1;
+            for (int i = 0; i < band_start && merged < 0; ++i) {
+                if (dirty[i].x0 == run.x0 && dirty[i].x1 == run.x1 && dirty[i].y1 == top) {
+                    merged = i;
+                }
+            }
+            if (merged >= 0) {
+                dirty[merged].y1 = bottom;
+            } else if (count < max_dirty) {
+                dirty[count++] = run;
+            } else {
+                overflow = true;
+            }
+        }
+    }
+    free(changed);
+    free(scratch_b);
+    free(scratch_a);
+
+    if (overflow) {
+        dirty[0] = bounds;
+        count = 1;
+    }
+    *dirty_count = count;
+    return SC_OK;
+}
+
+void sc_animation_init(sc_animation *anim, int frame_w, int frame_h, const sc_point *points, int frame_count) {
+    memset(anim, 0, sizeof(*anim));
+    anim->frame_w = anim->output_w = frame_w;
+    anim->frame_h = anim->output_h = frame_h;
+    anim->delay_cs = 8; // 80 ms per frame
+    anim->points = points;
+    anim->frame_count = frame_count;
+}
+
+sc_rect sc_animation_bounds(const sc_animation *anim) {
+    int64_t x0 = INT_MAX, y0 = INT_MAX, x1 = 0, y1 = 0;
+    for (int i = 0; i < anim->frame_count; ++i) {
+        const sc_point p = anim->points[i];
+        x0 = p.x < x0 ? p.x : x0;
+        y0 = p.y < y0 ? p.y : y0;
+        x1 = (int64_t)p.x + anim->frame_w > x1 ? (int64_t)p.x + anim->frame_w : x1;
+        y1 = (int64_t)p.y + anim->frame_h > y1 ? (int64_t)p.y + anim->frame_h : y1;
+    }
+    sc_rect box;
+    box.x0 = (int)x0;
+    box.y0 = (int)y0;
+    box.x1 = (int)(x1 < INT_MAX ? x1 : INT_MAX);
+    box.y1 = (int)(y1 < INT_MAX ? y1 : INT_MAX);
+    return box;
+}
+
+// Checks that anim describes at least one frame and that every frame lies within the sheet
+// and within the part of it that was decoded.
+static sc_status validate_animation(sc_context *ctx, const sc_sheet *sheet, const sc_animation *anim) {
+    if (anim->frame_w <= 0 || anim->frame_h <= 0 || anim->output_w <= 0 || anim->output_h <= 0 ||
+        anim->frame_count <= 0 || !anim->points) {
+        return fail(ctx, SC_ERROR_INVALID_ARGUMENT, "Animation needs a positive frame size and at least one frame");
+    }
+    for (int i = 0; i < anim->frame_count; ++i) {
+        const sc_point origin = anim->points[i];
+        if (!frame_in_bounds(sheet->w, sheet->h, anim->frame_w, anim->frame_h, origin)) {
+            return fail(ctx, SC_ERROR_OUT_OF_BOUNDS, "Frame %d with origin (%d,%d) is out of bounds for image %dx%d",
+                        i + 1, origin.x, origin.y, sheet->w, sheet->h);
+        }
+        if (origin.x < sheet->region.x0 || origin.y < sheet->region.y0 ||
+            origin.x + anim->frame_w > sheet->region.x1 || origin.y + anim->frame_h > sheet->region.y1) {
+            return fail(ctx, SC_ERROR_OUT_OF_BOUNDS, "Frame %d with origin (%d,%d) is outside the region of the image that was loaded",
+                        i + 1, origin.x, origin.y);
+        }
+    }
+    return SC_OK;
+}
+
+sc_status sc_extract_frames(sc_context *ctx, const sc_sheet *sheet, const sc_animation *anim, uint8_t *pixels) {
+    ctx->error[0] = '\0';
+    sc_status status = validate_animation(ctx, sheet, anim);
+    if (status != SC_OK) {
+        return status;
+    }
+    Scaler scaler;
+    if (!scaler_init(&scaler, anim->frame_w, anim->frame_h, anim->output_w, anim->output_h)) {
+        return fail(ctx, SC_ERROR_OUT_OF_MEMORY, "Memory allocation failed for scaled buffer");
+    }
+    status = reserve_frame_buffers(ctx, &ctx->buffers[0], anim, false);
+    if (status == SC_OK) {
+        const FramePipeline pipeline = { .sheet = sheet, .anim = anim, .scaler = &scaler };
+        const size_t frame_size = (size_t)anim->output_w * (size_t)anim->output_h * 4;
+        for (int i = 0; i < anim->frame_count; ++i) {
+            extract_frame(&pipeline, i, pixels + (size_t)i * frame_size, ctx->buffers[0].row);
+        }
+    }
+    scaler_free(&scaler);
+    return status;
+}
+
+// Encodes anim into writer, which hands the GIF to write(user) or, without a write function,
+// keeps all of it in writer->out.
+static sc_status encode_gif(sc_context *ctx, const sc_sheet *sheet, const sc_animation *anim, GifWriter *writer, GifWriteFunc write, void *user, sc_encode_info *info) {
+    ctx->error[0] = '\0';
+    if (info) {
+        memset(info, 0, sizeof(*info));
+    }
+    sc_status status = validate_animation(ctx, sheet, anim);
+    if (status != SC_OK) {
+        return status;
+    }
+
+    // The transparent color becomes entry 0 of the palette. keep_palette falls back to the
+    // usual palettes when the sheet has no usable palette.
+    GifEncoder settings;
+    GifInitEncoder(&settings);
+    set_transparent_color(&settings, anim);
+    GifGlobalPalette *global_palette = NULL;
+    uint8_t index_map[256][4];
+    bool indexed = false;
+    if (anim->keep_palette || anim->global_palette) {
+        global_palette = (GifGlobalPalette *)malloc(sizeof(GifGlobalPalette));
+        if (global_palette && anim->keep_palette) {
+            indexed = sheet->format == SHEET_INDEXED && build_indexed_palette(&settings, sheet, anim, global_palette, index_map);
+        }
+        if (!global_palette || (!indexed && anim->global_palette && !build_global_palette(&settings, sheet, anim, global_palette))) {
+            free(global_palette);
+            return fail(ctx, SC_ERROR_OUT_OF_MEMORY, "Memory allocation failed for global palette");
+        }
+        if (!indexed && !anim->global_palette) {
+            free(global_palette);
+            global_palette = NULL;
+        }
+    }
+
+    if (!GifBeginSink(writer, write, user, (uint32_t)anim->output_w, (uint32_t)anim->output_h, anim->delay_cs, global_palette)) {
+        free(global_palette);
+        return fail(ctx, SC_ERROR_OUT_OF_MEMORY, "Memory allocation failed for GIF writer");
+    }
+    set_transparent_color(&writer->encoder, anim);
+
+    Scaler scaler;
+    if (!scaler_init(&scaler, anim->frame_w, anim->frame_h, anim->output_w, anim->output_h)) {
+        GifEnd(writer);
+        GifFreeBuffer(&writer->out);
+        free(global_palette);
+        return fail(ctx, SC_ERROR_OUT_OF_MEMORY, "Memory allocation failed for scaled buffer");
+    }
+
+    FramePipeline pipeline = {
+        .sheet = sheet,
+        .anim = anim,
+        .scaler = &scaler,
+        .global_palette = global_palette,
+        .index_map = indexed ? (const uint8_t (*)[4])index_map : NULL,
+        .cache_dir = ctx->cache_dir,
+    };
+    if (ctx->cache_dir) {
+        pipeline.cache_settings = hash_encoding_settings(anim, &settings, global_palette);
+    }
+
+    PlannedFrame *plan = NULL;
+    status = reserve_frame_buffers(ctx, &ctx->buffers[0], anim, true);
+    if (status == SC_OK) {
+        status = plan_frames(ctx, &pipeline, &ctx->buffers[0], &plan, &pipeline.plan_count);
+    }
+    if (status == SC_OK) {
+        pipeline.plan = plan;
+        pipeline.encoded = (EncodedFrame *)calloc((size_t)pipeline.plan_count, sizeof(EncodedFrame));
+        if (!pipeline.encoded) {
+            status = fail(ctx, SC_ERROR_OUT_OF_MEMORY, "Memory allocation failed for frame buffer");
+        }
+    }
+    if (status == SC_OK) {
+        const int jobs = ctx->jobs < pipeline.plan_count ? ctx->jobs : pipeline.plan_count;
+        status = jobs > 1 ? write_frames_parallel(ctx, &pipeline, writer, jobs)
+                          : write_frames_serial(ctx, &pipeline, writer);
+    }
+
+    if (!GifEnd(writer) && status == SC_OK) {
+        status = fail(ctx, SC_ERROR_WRITE_FAILED, "Failed to write output GIF");
+    }
+    if (pipeline.encoded) {
+        for (int k = 0; k < pipeline.plan_count; ++k) {
+            free(pipeline.encoded[k].data);
+        }
+        free(pipeline.encoded);
+    }
+    free(plan);
+    scaler_free(&scaler);
+    free(global_palette);
+    if (status != SC_OK) {
+        GifFreeBuffer(&writer->out);
+    } else if (info) {
+        info->palette_kept = indexed;
+    }
+    return status;
+}
+
+// Passes the GIF on to the caller's write function, counting its bytes.
+typedef struct {
+    sc_write_func write;
+    void *user;
+    size_t size;
+} CountingSink;
+
+static bool write_counted(void *context, const uint8_t *data, size_t size) {
+    CountingSink *sink = (CountingSink *)context;
+    sink->size += size;
+    return sink->write(sink->user, data, size);
+}
+
+sc_status sc_encode_gif(sc_context *ctx, const sc_sheet *sheet, const sc_animation *anim, sc_write_func write, void *user, sc_encode_info *info) {
+    if (!write) {
+        return fail(ctx, SC_ERROR_INVALID_ARGUMENT, "No write function given");
+    }
+    CountingSink sink = { write, user, 0 };
+    GifWriter writer;
+    const sc_status status = encode_gif(ctx, sheet, anim, &writer, write_counted, &sink, info);
+    if (status == SC_OK && info) {
+        info->size = sink.size;
+    }
+    return status;
+}
+
+sc_status sc_encode_gif_to_buffer(sc_context *ctx, const sc_sheet *sheet, const sc_animation *anim, uint8_t **data, size_t *size, sc_encode_info *info) {
+    *data = NULL;
+    *size = 0;
+    GifWriter writer;
+    const sc_status status = encode_gif(ctx, sheet, anim, &writer, NULL, NULL, info);
+    if (status == SC_OK) {
+        *data = writer.out.data;
+        *size = writer.out.size;
+        if (info) {
+            info->size = writer.out.size;
+        }
+    }
+    return status;
+}
+
+void sc_free(void *data) {
+    free(data);
+}
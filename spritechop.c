@@ -1,21 +1,48 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <errno.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
 
-#define STB_IMAGE_IMPLEMENTATION
-#include "include/stb_image.h"
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
-#define GIF_H_IMPLEMENTATION
-#include "include/gif.h"
+#include "include/spritechop.h"
 
+// Everything needed to produce one output GIF from a sheet: where it goes, and the
+// sc_animation to cut for it (see to_sc_animation).
 typedef struct {
-    int x;
-    int y;
-} Point;
+    const char *output_path;
+    int frame_w;
+    int frame_h;
+    int output_w;
+    int output_h;
+    uint32_t delay_cs;
+    bool transparency_color_set;
+    uint8_t transparency_r;
+    uint8_t transparency_g;
+    uint8_t transparency_b;
+    bool delta;
+    bool global_palette;
+    bool keep_palette;
+    sc_point *points;
+    int frame_count;
+} Animation;
 
 typedef enum {
     EXIT_ARGS_MISSING = 2,
@@ -42,15 +69,40 @@ typedef enum {
     EXIT_SCALED_BUFFER_ALLOCATION_FAILED,
     EXIT_FRAME_OUT_OF_BOUNDS,
     EXIT_WRITE_FRAME_FAILED,
+    EXIT_MISSING_JOBS_VALUE,
+    EXIT_INVALID_JOBS_VALUE,
+    EXIT_WORKER_START_FAILED,
+    EXIT_MISSING_MANIFEST_VALUE,
+    EXIT_MANIFEST_OPEN_FAILED,
+    EXIT_MANIFEST_EMPTY,
+    EXIT_KEY_SHEET_CONFLICT,
+    EXIT_STDIO_CONFLICT,
+    EXIT_MISSING_CACHE_VALUE,
+    EXIT_CACHE_DIR_FAILED,
+    EXIT_MISSING_SERVE_VALUE,
+    EXIT_MISSING_SHEET_MEMORY_VALUE,
+    EXIT_INVALID_SHEET_MEMORY_VALUE,
+    EXIT_SERVE_CONFLICT,
+    EXIT_SERVE_FAILED,
+    EXIT_WATCH_CONFLICT,
+    EXIT_WATCH_FAILED,
+    EXIT_REQUEST_TOO_LONG,
 } SpritechopExitCode;
 
 static void usage(const char *prog) {
-    fprintf(stderr, "Usage: %s -i <input image> -o <output image> -s <width>x<height> [-so <out width>x<out height>] [-f <delay cs>] [-t <hex color>] <x1,y1> [x2,y2 ...]\n", prog);
-    fprintf(stderr, "Options may appear in any order before the coordinates. Size uses the form 80x114. -so rescales each frame from the input size, -f sets frame delay in centiseconds (default 8 = 80ms), and -t sets a transparency color like #ff00ff or ff00ff.\n");
+    if (!prog) {
+        return; // requests to a server get only the error
+    }
+    fprintf(stderr, "Usage: %s -i <input image> -o <output image> -s <width>x<height> [-so <out width>x<out height>] [-f <delay cs>] [-t <hex color> [--key-sheet]] [--delta] [--global-palette] [--keep-palette] [-j <jobs>] [--cache <dir>] [--watch] <x1,y1> [x2,y2 ...]\n", prog);
+    fprintf(stderr, "Options may appear in any order before the coordinates. Use - as the input or output to read the sheet from stdin or write the GIF to stdout. Size uses the form 80x114. -so rescales each frame from the input size, -f sets frame delay in centiseconds (default 8 = 80ms), -t sets a transparency color like #ff00ff or ff00ff (--key-sheet applies it once to the whole sheet instead of to every frame), --delta stores only the pixels that change between frames, --global-palette shares one color table between all frames, --keep-palette reuses the palette of an indexed PNG sheet as is, -j encodes frames on that many threads (0 = one per CPU), --cache keeps decoded sheets and encoded frames in a directory so that later runs skip decoding unchanged sheets and encoding unchanged frames, and --watch keeps running after writing the GIFs and rewrites those whose frames change each time the input image is saved.\n");
+    fprintf(stderr, "       %s -i <input image> --manifest <file|-> [-s ...] [-so ...] [-f ...] [-t ... [--key-sheet]] [--delta] [--global-palette] [--keep-palette] [-j <jobs>] [--cache <dir>] [--watch]\n", prog);
+    fprintf(stderr, "A manifest lists one GIF per line as -o <output> [-s/-so/-f/-t/--delta/--global-palette/--keep-palette ...] <x1,y1> [x2,y2 ...]; options on the command line are defaults for every line.\n");
+    fprintf(stderr, "       %s --serve <socket> [-j <workers>] [--sheet-memory <MiB>] [--cache <dir>] [-s ...] [-so ...] [-f ...] [-t ...] [--delta] [--global-palette] [--keep-palette]\n", prog);
+    fprintf(stderr, "A server reads requests from a Unix socket, one per line as -i <input> [-s/-so/-f/-t/--delta/--global-palette/--keep-palette ...] <x1,y1> [x2,y2 ...], and answers each with \"OK <size>\" and the GIF or \"ERROR <exit code> <size>\" and the message. It keeps up to --sheet-memory MiB of decoded sheets (default 256) and encodes on -j worker threads.\n");
     fprintf(stderr, "Example: %s -i ninja.png -s 80x114 -o ninja.gif 35,24 159,24 278,24 397,24\n", prog);
 }
 
-static bool parse_coord(const char *arg, Point *out) {
+static bool parse_coord(const char *arg, sc_point *out) {
     const char *comma = strchr(arg, ',');
     if (!comma) {
         return false;
@@ -138,285 +190,1372 @@ static bool parse_hex_color(const char *arg, uint8_t *r, uint8_t *g, uint8_t *b)
     return true;
 }
 
-static void resize_nearest(const uint8_t *src, int src_w, int src_h, uint8_t *dst, int dst_w, int dst_h) {
-    for (int y = 0; y < dst_h; ++y) {
-        const int src_y = (y * src_h) / dst_h;
-        const uint8_t *src_row = src + ((size_t)src_y * (size_t)src_w * 4);
-        uint8_t *dst_row = dst + ((size_t)y * (size_t)dst_w * 4);
-        for (int x = 0; x < dst_w; ++x) {
-            const int src_x = (x * src_w) / dst_w;
-            const uint8_t *src_px = src_row + (size_t)src_x * 4;
-            uint8_t *dst_px = dst_row + (size_t)x * 4;
-            dst_px[0] = src_px[0];
-            dst_px[1] = src_px[1];
-            dst_px[2] = src_px[2];
-            dst_px[3] = src_px[3];
-        }
-    }
-}
-
-static bool copy_frame(uint8_t *dst, const uint8_t *src, int src_w, int src_h, int frame_w, int frame_h, Point origin) {
-    if (origin.x < 0 || origin.y < 0) {
-        return false;
-    }
-    if (origin.x + frame_w > src_w || origin.y + frame_h > src_h) {
-        return false;
-    }
-
-    const int stride_src = src_w * 4;
-    const int stride_dst = frame_w * 4;
-    for (int row = 0; row < frame_h; ++row) {
-        const uint8_t *src_row = src + ((origin.y + row) * stride_src) + origin.x * 4;
-        uint8_t *dst_row = dst + row * stride_dst;
-        memcpy(dst_row, src_row, (size_t)stride_dst);
-    }
-    return true;
-}
-
-static void apply_transparency_color(uint8_t *pixels, int w, int h, uint8_t r, uint8_t g, uint8_t b) {
-    const size_t count = (size_t)w * (size_t)h;
-    for (size_t i = 0; i < count; ++i) {
-        uint8_t *px = pixels + i * 4;
-        if (px[0] == r && px[1] == g && px[2] == b) {
-            px[3] = 0;
-        }
-    }
+// "-" names stdin or stdout.
+static bool is_stdio_path(const char *path) {
+    return strcmp(path, "-") == 0;
 }
 
-int main(int argc, char **argv) {
-    if (argc < 2) {
-        fprintf(stderr, "No arguments provided (exit code %d)\n", EXIT_ARGS_MISSING);
-        usage(argv[0]);
-        return EXIT_ARGS_MISSING;
-    }
+typedef struct {
+    const char *input_path;
+    const char *manifest_path;
+    const char *cache_dir;
+    const char *serve_path;
+    size_t sheet_memory; // bytes of decoded sheets a server keeps
+    int jobs;
+    bool key_sheet;
+    bool watch;
+    Animation anim;
+} Options;
 
-    const char *input_path = NULL;
-    const char *output_path = NULL;
-    int frame_w = 0;
-    int frame_h = 0;
-    int output_w = 0;
-    int output_h = 0;
-    uint32_t delay_cs = 8; // default to 80 ms per frame
-    bool transparency_color_set = false;
-    uint8_t transparency_r = 0;
-    uint8_t transparency_g = 0;
-    uint8_t transparency_b = 0;
+// Where options come from: manifest lines may only carry per-animation options, and requests
+// to a server may also name their input but write to the socket rather than to -o. Everything
+// else belongs on the command line.
+typedef enum {
+    OPTIONS_COMMAND_LINE,
+    OPTIONS_MANIFEST_LINE,
+    OPTIONS_REQUEST,
+} OptionScope;
 
-    int argi = 1;
-    for (; argi < argc; ++argi) {
-        const char *arg = argv[argi];
-        if (strcmp(arg, "-i") == 0) {
-            if (argi + 1 >= argc) {
-                fprintf(stderr, "Missing value for -i (exit code %d)\n", EXIT_MISSING_INPUT_VALUE);
-                usage(argv[0]);
+// Parses options starting at args[*argi] until the first coordinate. Errors are reported to
+// err, followed by the usage text unless prog is NULL.
+static SpritechopExitCode parse_options(int argc, char **argv, int *argi, Options *opts, OptionScope scope, FILE *err, const char *prog) {
+    for (; *argi < argc; ++*argi) {
+        const char *arg = argv[*argi];
+        if (strcmp(arg, "-i") == 0 && scope != OPTIONS_MANIFEST_LINE) {
+            if (*argi + 1 >= argc) {
+                fprintf(err, "Missing value for -i (exit code %d)\n", EXIT_MISSING_INPUT_VALUE);
+                usage(prog);
                 return EXIT_MISSING_INPUT_VALUE;
             }
-            input_path = argv[++argi];
+            opts->input_path = argv[++*argi];
             continue;
         }
-        if (strcmp(arg, "-o") == 0) {
-            if (argi + 1 >= argc) {
-                fprintf(stderr, "Missing value for -o (exit code %d)\n", EXIT_MISSING_OUTPUT_VALUE);
-                usage(argv[0]);
+        if (strcmp(arg, "-o") == 0 && scope != OPTIONS_REQUEST) {
+            if (*argi + 1 >= argc) {
+                fprintf(err, "Missing value for -o (exit code %d)\n", EXIT_MISSING_OUTPUT_VALUE);
+                usage(prog);
                 return EXIT_MISSING_OUTPUT_VALUE;
             }
-            output_path = argv[++argi];
+            opts->anim.output_path = argv[++*argi];
             continue;
         }
         if (strcmp(arg, "-s") == 0) {
-            if (argi + 1 >= argc) {
-                fprintf(stderr, "Missing value for -s (exit code %d)\n", EXIT_MISSING_SIZE_VALUE);
-                usage(argv[0]);
+            if (*argi + 1 >= argc) {
+                fprintf(err, "Missing value for -s (exit code %d)\n", EXIT_MISSING_SIZE_VALUE);
+                usage(prog);
                 return EXIT_MISSING_SIZE_VALUE;
             }
-            if (!parse_size(argv[argi + 1], &frame_w, &frame_h)) {
-                fprintf(stderr, "Invalid size (expected <width>x<height>): %s (exit code %d)\n", argv[argi + 1], EXIT_INVALID_SIZE_VALUE);
-                usage(argv[0]);
+            if (!parse_size(argv[*argi + 1], &opts->anim.frame_w, &opts->anim.frame_h)) {
+                fprintf(err, "Invalid size (expected <width>x<height>): %s (exit code %d)\n", argv[*argi + 1], EXIT_INVALID_SIZE_VALUE);
+                usage(prog);
                 return EXIT_INVALID_SIZE_VALUE;
             }
-            ++argi;
+            ++*argi;
             continue;
         }
         if (strcmp(arg, "-so") == 0) {
-            if (argi + 1 >= argc) {
-                fprintf(stderr, "Missing value for -so (exit code %d)\n", EXIT_MISSING_OUTPUT_SIZE_VALUE);
-                usage(argv[0]);
+            if (*argi + 1 >= argc) {
+                fprintf(err, "Missing value for -so (exit code %d)\n", EXIT_MISSING_OUTPUT_SIZE_VALUE);
+                usage(prog);
                 return EXIT_MISSING_OUTPUT_SIZE_VALUE;
             }
-            if (!parse_size(argv[argi + 1], &output_w, &output_h)) {
-                fprintf(stderr, "Invalid output size (expected <width>x<height>): %s (exit code %d)\n", argv[argi + 1], EXIT_INVALID_OUTPUT_SIZE_VALUE);
-                usage(argv[0]);
+            if (!parse_size(argv[*argi + 1], &opts->anim.output_w, &opts->anim.output_h)) {
+                fprintf(err, "Invalid output size (expected <width>x<height>): %s (exit code %d)\n", argv[*argi + 1], EXIT_INVALID_OUTPUT_SIZE_VALUE);
+                usage(prog);
                 return EXIT_INVALID_OUTPUT_SIZE_VALUE;
             }
-            ++argi;
+            ++*argi;
             continue;
         }
         if (strcmp(arg, "-f") == 0) {
-            if (argi + 1 >= argc) {
-                fprintf(stderr, "Missing value for -f (exit code %d)\n", EXIT_MISSING_DELAY_VALUE);
-                usage(argv[0]);
+            if (*argi + 1 >= argc) {
+                fprintf(err, "Missing value for -f (exit code %d)\n", EXIT_MISSING_DELAY_VALUE);
+                usage(prog);
                 return EXIT_MISSING_DELAY_VALUE;
             }
             errno = 0;
             char *endptr = NULL;
-            long parsed_delay = strtol(argv[argi + 1], &endptr, 10);
+            long parsed_delay = strtol(argv[*argi + 1], &endptr, 10);
             if (errno != 0 || *endptr != '\0' || parsed_delay <= 0 || (unsigned long)parsed_delay > UINT32_MAX) {
-                fprintf(stderr, "Invalid frame delay (expected positive centiseconds): %s (exit code %d)\n", argv[argi + 1], EXIT_INVALID_DELAY_VALUE);
-                usage(argv[0]);
+                fprintf(err, "Invalid frame delay (expected positive centiseconds): %s (exit code %d)\n", argv[*argi + 1], EXIT_INVALID_DELAY_VALUE);
+                usage(prog);
                 return EXIT_INVALID_DELAY_VALUE;
             }
-            delay_cs = (uint32_t)parsed_delay;
-            ++argi;
+            opts->anim.delay_cs = (uint32_t)parsed_delay;
+            ++*argi;
             continue;
         }
         if (strcmp(arg, "-t") == 0) {
-            if (argi + 1 >= argc) {
-                fprintf(stderr, "Missing value for -t (exit code %d)\n", EXIT_MISSING_TRANSPARENCY_VALUE);
-                usage(argv[0]);
+            if (*argi + 1 >= argc) {
+                fprintf(err, "Missing value for -t (exit code %d)\n", EXIT_MISSING_TRANSPARENCY_VALUE);
+                usage(prog);
                 return EXIT_MISSING_TRANSPARENCY_VALUE;
             }
-            if (!parse_hex_color(argv[argi + 1], &transparency_r, &transparency_g, &transparency_b)) {
-                fprintf(stderr, "Invalid transparency color (expected hex like ff00ff or #ff00ff): %s (exit code %d)\n", argv[argi + 1], EXIT_INVALID_TRANSPARENCY_VALUE);
-                usage(argv[0]);
+            if (!parse_hex_color(argv[*argi + 1], &opts->anim.transparency_r, &opts->anim.transparency_g, &opts->anim.transparency_b)) {
+                fprintf(err, "Invalid transparency color (expected hex like ff00ff or #ff00ff): %s (exit code %d)\n", argv[*argi + 1], EXIT_INVALID_TRANSPARENCY_VALUE);
+                usage(prog);
                 return EXIT_INVALID_TRANSPARENCY_VALUE;
             }
-            transparency_color_set = true;
-            ++argi;
+            opts->anim.transparency_color_set = true;
+            ++*argi;
+            continue;
+        }
+        if (strcmp(arg, "--delta") == 0) {
+            opts->anim.delta = true;
+            continue;
+        }
+        if (strcmp(arg, "--global-palette") == 0) {
+            opts->anim.global_palette = true;
+            continue;
+        }
+        if (strcmp(arg, "--keep-palette") == 0) {
+            opts->anim.keep_palette = true;
+            continue;
+        }
+        if (strcmp(arg, "-j") == 0 && scope == OPTIONS_COMMAND_LINE) {
+            if (*argi + 1 >= argc) {
+                fprintf(err, "Missing value for -j (exit code %d)\n", EXIT_MISSING_JOBS_VALUE);
+                usage(prog);
+                return EXIT_MISSING_JOBS_VALUE;
+            }
+            errno = 0;
+            char *endptr = NULL;
+            long parsed_jobs = strtol(argv[*argi + 1], &endptr, 10);
+            if (errno != 0 || *endptr != '\0' || parsed_jobs < 0 || parsed_jobs > 1024) {
+                fprintf(err, "Invalid job count (expected 0-1024): %s (exit code %d)\n", argv[*argi + 1], EXIT_INVALID_JOBS_VALUE);
+                usage(prog);
+                return EXIT_INVALID_JOBS_VALUE;
+            }
+            opts->jobs = (int)parsed_jobs; // 0 lets the library use one per CPU
+            ++*argi;
+            continue;
+        }
+        if (strcmp(arg, "--key-sheet") == 0 && scope == OPTIONS_COMMAND_LINE) {
+            opts->key_sheet = true;
+            continue;
+        }
+        if (strcmp(arg, "--watch") == 0 && scope == OPTIONS_COMMAND_LINE) {
+            opts->watch = true;
+            continue;
+        }
+        if (strcmp(arg, "--cache") == 0 && scope == OPTIONS_COMMAND_LINE) {
+            if (*argi + 1 >= argc) {
+                fprintf(err, "Missing value for --cache (exit code %d)\n", EXIT_MISSING_CACHE_VALUE);
+                usage(prog);
+                return EXIT_MISSING_CACHE_VALUE;
+            }
+            opts->cache_dir = argv[++*argi];
+            continue;
+        }
+        if (strcmp(arg, "--serve") == 0 && scope == OPTIONS_COMMAND_LINE) {
+            if (*argi + 1 >= argc) {
+                fprintf(err, "Missing value for --serve (exit code %d)\n", EXIT_MISSING_SERVE_VALUE);
+                usage(prog);
+                return EXIT_MISSING_SERVE_VALUE;
+            }
+            opts->serve_path = argv[++*argi];
+            continue;
+        }
+        if (strcmp(arg, "--sheet-memory") == 0 && scope == OPTIONS_COMMAND_LINE) {
+            if (*argi + 1 >= argc) {
+                fprintf(err, "Missing value for --sheet-memory (exit code %d)\n", EXIT_MISSING_SHEET_MEMORY_VALUE);
+                usage(prog);
+                return EXIT_MISSING_SHEET_MEMORY_VALUE;
+            }
+            errno = 0;
+            char *endptr = NULL;
+            long parsed_memory = strtol(argv[*argi + 1], &endptr, 10);
+            if (errno != 0 || *endptr != '\0' || parsed_memory < 0 || (unsigned long)parsed_memory > SIZE_MAX >> 20) {
+                fprintf(err, "Invalid sheet memory (expected MiB): %s (exit code %d)\n", argv[*argi + 1], EXIT_INVALID_SHEET_MEMORY_VALUE);
+                usage(prog);
+                return EXIT_INVALID_SHEET_MEMORY_VALUE;
+            }
+            opts->sheet_memory = (size_t)parsed_memory << 20;
+            ++*argi;
+            continue;
+        }
+        if (strcmp(arg, "--manifest") == 0 && scope == OPTIONS_COMMAND_LINE) {
+            if (*argi + 1 >= argc) {
+                fprintf(err, "Missing value for --manifest (exit code %d)\n", EXIT_MISSING_MANIFEST_VALUE);
+                usage(prog);
+                return EXIT_MISSING_MANIFEST_VALUE;
+            }
+            opts->manifest_path = argv[++*argi];
             continue;
         }
         if (arg[0] == '-') {
-            fprintf(stderr, "Unknown option: %s (exit code %d)\n", arg, EXIT_UNKNOWN_OPTION_VALUE);
-            usage(argv[0]);
+            fprintf(err, "Unknown option: %s (exit code %d)\n", arg, EXIT_UNKNOWN_OPTION_VALUE);
+            usage(prog);
             return EXIT_UNKNOWN_OPTION_VALUE;
         }
         break;
     }
+    return EXIT_SUCCESS;
+}
 
-    if (!input_path) {
-        fprintf(stderr, "Input image is required (-i) (exit code %d)\n", EXIT_INPUT_REQUIRED);
-        usage(argv[0]);
-        return EXIT_INPUT_REQUIRED;
-    }
-    if (!output_path) {
-        fprintf(stderr, "Output image is required (-o) (exit code %d)\n", EXIT_OUTPUT_REQUIRED);
-        usage(argv[0]);
+// Validates the parsed animation options and parses the coordinate arguments that follow them.
+static SpritechopExitCode finish_animation(Animation *anim, int coord_count, char **coords, FILE *err, const char *prog) {
+    if (!anim->output_path) {
+        fprintf(err, "Output image is required (-o) (exit code %d)\n", EXIT_OUTPUT_REQUIRED);
+        usage(prog);
         return EXIT_OUTPUT_REQUIRED;
     }
-    if (frame_w == 0 || frame_h == 0) {
-        fprintf(stderr, "Frame size is required (-s <width>x<height>) (exit code %d)\n", EXIT_FRAME_SIZE_REQUIRED);
-        usage(argv[0]);
+    if (anim->frame_w == 0 || anim->frame_h == 0) {
+        fprintf(err, "Frame size is required (-s <width>x<height>) (exit code %d)\n", EXIT_FRAME_SIZE_REQUIRED);
+        usage(prog);
         return EXIT_FRAME_SIZE_REQUIRED;
     }
-    if (output_w == 0 || output_h == 0) {
-        output_w = frame_w;
-        output_h = frame_h;
+    if (anim->output_w == 0 || anim->output_h == 0) {
+        anim->output_w = anim->frame_w;
+        anim->output_h = anim->frame_h;
     }
 
-    const int frame_count = argc - argi;
-    if (frame_count <= 0) {
-        fprintf(stderr, "At least one coordinate is required (exit code %d)\n", EXIT_COORDINATES_REQUIRED);
-        usage(argv[0]);
+    if (coord_count <= 0) {
+        fprintf(err, "At least one coordinate is required (exit code %d)\n", EXIT_COORDINATES_REQUIRED);
+        usage(prog);
         return EXIT_COORDINATES_REQUIRED;
     }
 
-    Point *points = (Point *)malloc(sizeof(Point) * (size_t)frame_count);
-    if (!points) {
-        fprintf(stderr, "Memory allocation failed for coordinate list (exit code %d)\n", EXIT_POINTS_ALLOCATION_FAILED);
+    anim->points = (sc_point *)malloc(sizeof(sc_point) * (size_t)coord_count);
+    if (!anim->points) {
+        fprintf(err, "Memory allocation failed for coordinate list (exit code %d)\n", EXIT_POINTS_ALLOCATION_FAILED);
         return EXIT_POINTS_ALLOCATION_FAILED;
     }
 
-    for (int i = 0; i < frame_count; ++i) {
-        if (!parse_coord(argv[argi + i], &points[i])) {
-            fprintf(stderr, "Invalid coordinate: %s (expected x,y) (exit code %d)\n", argv[argi + i], EXIT_INVALID_COORDINATE_VALUE);
-            free(points);
+    for (int i = 0; i < coord_count; ++i) {
+        if (!parse_coord(coords[i], &anim->points[i])) {
+            fprintf(err, "Invalid coordinate: %s (expected x,y) (exit code %d)\n", coords[i], EXIT_INVALID_COORDINATE_VALUE);
+            free(anim->points);
+            anim->points = NULL;
             return EXIT_INVALID_COORDINATE_VALUE;
         }
     }
+    anim->frame_count = coord_count;
+    return EXIT_SUCCESS;
+}
 
-    int img_w = 0, img_h = 0, channels = 0;
-    uint8_t *img = stbi_load(input_path, &img_w, &img_h, &channels, 4);
-    if (!img) {
-        fprintf(stderr, "Failed to load image '%s': %s (exit code %d)\n", input_path, stbi_failure_reason(), EXIT_IMAGE_LOAD_FAILED);
-        free(points);
-        return EXIT_IMAGE_LOAD_FAILED;
+// A manifest lists one animation per line using the same -o/-s/-so/-f/-t options and
+// coordinates as the command line. Blank lines and lines starting with '#' are skipped.
+typedef struct {
+    Animation *anims;
+    int count;
+    char **lines;
+    int line_count;
+} Manifest;
+
+static void free_manifest(Manifest *manifest) {
+    for (int i = 0; i < manifest->count; ++i) {
+        free(manifest->anims[i].points);
+    }
+    for (int i = 0; i < manifest->line_count; ++i) {
+        free(manifest->lines[i]);
     }
+    free(manifest->anims);
+    free(manifest->lines);
+}
 
-    if (transparency_color_set) {
-        GifSetTransparentColor(transparency_r, transparency_g, transparency_b);
+static void *grow_array(void *array, int *capacity, int needed, size_t elem_size) {
+    if (needed <= *capacity) {
+        return array;
+    }
+    int new_capacity = *capacity ? *capacity * 2 : 16;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    void *grown = realloc(array, (size_t)new_capacity * elem_size);
+    if (grown) {
+        *capacity = new_capacity;
     }
+    return grown;
+}
 
-    GifWriter writer = {0};
+static sc_animation to_sc_animation(const Animation *anim) {
+    sc_animation out;
+    sc_animation_init(&out, anim->frame_w, anim->frame_h, anim->points, anim->frame_count);
+    out.output_w = anim->output_w;
+    out.output_h = anim->output_h;
+    out.delay_cs = anim->delay_cs;
+    out.transparency_color_set = anim->transparency_color_set;
+    out.transparency_r = anim->transparency_r;
+    out.transparency_g = anim->transparency_g;
+    out.transparency_b = anim->transparency_b;
+    out.delta = anim->delta;
+    out.global_palette = anim->global_palette;
+    out.keep_palette = anim->keep_palette;
+    return out;
+}
 
-    if (!GifBegin(&writer, output_path, (uint32_t)output_w, (uint32_t)output_h, delay_cs, 8, false)) {
+// The smallest rectangle of the sheet covering every frame of every animation, clipped to
+// non-negative coordinates. Frames outside the sheet are reported once its size is known.
+static sc_rect frames_bounding_box(const Manifest *manifest) {
+    sc_rect box = { INT_MAX, INT_MAX, 0, 0 };
+    for (int i = 0; i < manifest->count; ++i) {
+        const sc_animation anim = to_sc_animation(&manifest->anims[i]);
+        const sc_rect bounds = sc_animation_bounds(&anim);
+        box.x0 = bounds.x0 < box.x0 ? bounds.x0 : box.x0;
+        box.y0 = bounds.y0 < box.y0 ? bounds.y0 : box.y0;
+        box.x1 = bounds.x1 > box.x1 ? bounds.x1 : box.x1;
+        box.y1 = bounds.y1 > box.y1 ? bounds.y1 : box.y1;
+    }
+    box.x0 = box.x0 > 0 ? box.x0 : 0;
+    box.y0 = box.y0 > 0 ? box.y0 : 0;
+    return box;
+}
+
+static SpritechopExitCode load_manifest(const char *path, const Animation *defaults, Manifest *manifest, const char *prog) {
+    memset(manifest, 0, sizeof(*manifest));
+    FILE *f = is_stdio_path(path) ? stdin : fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Failed to open manifest '%s': %s (exit code %d)\n", path, strerror(errno), EXIT_MANIFEST_OPEN_FAILED);
+        return EXIT_MANIFEST_OPEN_FAILED;
+    }
+
+    SpritechopExitCode exit_code = EXIT_SUCCESS;
+    int anim_capacity = 0;
+    int line_capacity = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    int line_number = 0;
+    while (exit_code == EXIT_SUCCESS && getline(&line, &line_size, f) >= 0) {
+        ++line_number;
+
+        int token_count = 0;
+        int token_capacity = 0;
+        char **tokens = NULL;
+        for (char *tok = strtok(line, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+            char **grown = (char **)grow_array(tokens, &token_capacity, token_count + 1, sizeof(char *));
+            if (!grown) {
+                exit_code = EXIT_POINTS_ALLOCATION_FAILED;
+                break;
+            }
+            tokens = grown;
+            tokens[token_count++] = tok;
+        }
+        if (exit_code != EXIT_SUCCESS) {
+            fprintf(stderr, "Memory allocation failed for manifest (exit code %d)\n", exit_code);
+            free(tokens);
+            break;
+        }
+        if (token_count == 0 || tokens[0][0] == '#') {
+            free(tokens);
+            continue;
+        }
+
+        // The animation keeps pointers into this line, so the manifest takes ownership of it.
+        char **lines = (char **)grow_array(manifest->lines, &line_capacity, manifest->line_count + 1, sizeof(char *));
+        Animation *anims = lines ? (Animation *)grow_array(manifest->anims, &anim_capacity, manifest->count + 1, sizeof(Animation)) : NULL;
+        if (lines) {
+            manifest->lines = lines;
+        }
+        if (anims) {
+            manifest->anims = anims;
+        }
+        if (!lines || !anims) {
+            exit_code = EXIT_POINTS_ALLOCATION_FAILED;
+            fprintf(stderr, "Memory allocation failed for manifest (exit code %d)\n", exit_code);
+            free(tokens);
+            break;
+        }
+        manifest->lines[manifest->line_count++] = line;
+        line = NULL;
+        line_size = 0;
+
+        Options line_opts = {0};
+        line_opts.anim = *defaults;
+        int argi = 0;
+        exit_code = parse_options(token_count, tokens, &argi, &line_opts, OPTIONS_MANIFEST_LINE, stderr, prog);
+        if (exit_code == EXIT_SUCCESS) {
+            exit_code = finish_animation(&line_opts.anim, token_count - argi, tokens + argi, stderr, prog);
+        }
+        if (exit_code == EXIT_SUCCESS) {
+            manifest->anims[manifest->count++] = line_opts.anim;
+        } else {
+            fprintf(stderr, "(in manifest '%s', line %d)\n", path, line_number);
+        }
+        free(tokens);
+    }
+    free(line);
+
+    if (f != stdin) {
+        fclose(f);
+    }
+    if (exit_code == EXIT_SUCCESS && manifest->count == 0) {
+        fprintf(stderr, "Manifest '%s' lists no animations (exit code %d)\n", path, EXIT_MANIFEST_EMPTY);
+        exit_code = EXIT_MANIFEST_EMPTY;
+    }
+    if (exit_code != EXIT_SUCCESS) {
+        free_manifest(manifest);
+        memset(manifest, 0, sizeof(*manifest));
+    }
+    return exit_code;
+}
+
+// Library failures are reported to err with the library's message and the exit code that
+// matches.
+static SpritechopExitCode report_failure(sc_context *ctx, sc_status status, const Animation *anim, FILE *err) {
+    SpritechopExitCode exit_code;
+    switch (status) {
+    case SC_ERROR_LOAD_FAILED:
+        exit_code = EXIT_IMAGE_LOAD_FAILED;
+        break;
+    case SC_ERROR_OUT_OF_BOUNDS:
+        exit_code = EXIT_FRAME_OUT_OF_BOUNDS;
+        break;
+    case SC_ERROR_OUT_OF_MEMORY: {
+        const bool scaled = anim->output_w != anim->frame_w || anim->output_h != anim->frame_h;
+        exit_code = scaled ? EXIT_SCALED_BUFFER_ALLOCATION_FAILED : EXIT_FRAME_BUFFER_ALLOCATION_FAILED;
+        break;
+    }
+    case SC_ERROR_THREAD_FAILED:
+        exit_code = EXIT_WORKER_START_FAILED;
+        break;
+    case SC_ERROR_WRITE_FAILED:
+        exit_code = EXIT_WRITE_FRAME_FAILED;
+        break;
+    default:
+        exit_code = EXIT_INVALID_SIZE_VALUE;
+        break;
+    }
+    fprintf(err, "%s (exit code %d)\n", sc_context_error(ctx), exit_code);
+    return exit_code;
+}
+
+static bool write_to_file(void *context, const uint8_t *data, size_t size) {
+    return fwrite(data, 1, size, (FILE *)context) == size;
+}
+
+// Opens a file next to output_path, in the same directory so it can be renamed over it, with
+// the output's current permissions (or the default ones if there is no output yet). temp
+// receives its name.
+static FILE *open_replacement(const char *output_path, char temp[PATH_MAX]) {
+    if (snprintf(temp, PATH_MAX, "%s.%ld.tmp", output_path, (long)getpid()) >= PATH_MAX) {
+        return NULL;
+    }
+    struct stat st;
+    const mode_t mode = stat(output_path, &st) == 0 ? (st.st_mode & 0777) : 0666;
+    unlink(temp); // left behind by an earlier process with the same pid
+    const int fd = open(temp, O_WRONLY | O_CREAT | O_EXCL, mode);
+    if (fd < 0) {
+        return NULL;
+    }
+    FILE *f = fdopen(fd, "wb");
+    if (!f) {
+        close(fd);
+        unlink(temp);
+    }
+    return f;
+}
+
+// Progress messages go to `status`, which is stderr whenever a GIF is written to stdout. With
+// `replace`, the GIF is written to a temporary file and renamed over the output only once it
+// is complete, so readers never see part of a GIF and a failure leaves the old one in place.
+static SpritechopExitCode write_animation(sc_context *ctx, const sc_sheet *sheet, const Animation *anim, bool replace, FILE *status) {
+    const sc_animation sc_anim = to_sc_animation(anim);
+    const bool to_stdout = is_stdio_path(anim->output_path);
+    replace = replace && !to_stdout;
+    char temp[PATH_MAX];
+    FILE *f = to_stdout ? stdout : replace ? open_replacement(anim->output_path, temp) : fopen(anim->output_path, "wb");
+    if (!f) {
         fprintf(stderr, "Failed to open output GIF for writing (exit code %d)\n", EXIT_GIF_BEGIN_FAILED);
-        stbi_image_free(img);
-        free(points);
         return EXIT_GIF_BEGIN_FAILED;
     }
+    if (!to_stdout) {
+        // output is already gathered a frame at a time, so stdio's buffer would only add a copy
+        setvbuf(f, NULL, _IONBF, 0);
+    }
+
+    sc_encode_info info;
+    const sc_status result = sc_encode_gif(ctx, sheet, &sc_anim, write_to_file, f, &info);
+    const bool closed = to_stdout ? fflush(stdout) == 0 : fclose(f) == 0;
+    SpritechopExitCode exit_code = EXIT_SUCCESS;
+    if (result != SC_OK) {
+        exit_code = report_failure(ctx, result, anim, stderr);
+    } else if (!closed || (replace && rename(temp, anim->output_path) != 0)) {
+        fprintf(stderr, "Failed to write output GIF (exit code %d)\n", EXIT_WRITE_FRAME_FAILED);
+        exit_code = EXIT_WRITE_FRAME_FAILED;
+    }
+    if (exit_code != EXIT_SUCCESS) {
+        if (!to_stdout) {
+            remove(replace ? temp : anim->output_path);
+        }
+        return exit_code;
+    }
+
+    if (anim->keep_palette && !info.palette_kept) {
+        fprintf(stderr, "Warning: --keep-palette needs an indexed PNG sheet whose frames use at most 255 colors; quantizing %s instead\n",
+                to_stdout ? "stdout" : anim->output_path);
+    }
+    fprintf(status, "Wrote %d frame(s) to %s (%dx%d)\n", anim->frame_count, to_stdout ? "stdout" : anim->output_path, anim->output_w, anim->output_h);
+    return EXIT_SUCCESS;
+}
+
+// Whether any frame of anim overlaps one of the dirty rectangles.
+static bool animation_touches(const Animation *anim, const sc_rect *dirty, int dirty_count) {
+    for (int i = 0; i < anim->frame_count; ++i) {
+        const sc_point p = anim->points[i];
+        for (int d = 0; d < dirty_count; ++d) {
+            if (p.x < dirty[d].x1 && p.y < dirty[d].y1 &&
+                (int64_t)p.x + anim->frame_w > dirty[d].x0 && (int64_t)p.y + anim->frame_h > dirty[d].y0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Loads the sheet again after it was saved and rewrites the animations whose frames cover
+// pixels that changed, along with any that failed to write before; the other outputs are left
+// alone. A sheet that fails to load keeps the previous one in place.
+static void rebuild_changed(sc_context *ctx, const Options *opts, const Manifest *manifest, sc_sheet **sheet, sc_rect needed, bool *pending, FILE *status) {
+    sc_sheet *updated = NULL;
+    if (sc_sheet_load(ctx, opts->input_path, &needed, &updated) != SC_OK) {
+        fprintf(stderr, "Failed to load image '%s': %s (exit code %d)\n", opts->input_path, sc_context_error(ctx), EXIT_IMAGE_LOAD_FAILED);
+        return;
+    }
+    if (opts->key_sheet) {
+        sc_sheet_apply_key(updated, opts->anim.transparency_r, opts->anim.transparency_g, opts->anim.transparency_b);
+    }
+    sc_rect dirty[64];
+    int dirty_count = 0;
+    if (sc_sheet_diff(ctx, *sheet, updated, needed, dirty, (int)(sizeof(dirty) / sizeof(dirty[0])), &dirty_count) != SC_OK) {
+        dirty[0] = needed;
+        dirty_count = 1;
+    }
+    sc_sheet_free(*sheet);
+    *sheet = updated;
+
+    int rebuilt = 0;
+    for (int i = 0; i < manifest->count; ++i) {
+        pending[i] = pending[i] || animation_touches(&manifest->anims[i], dirty, dirty_count);
+        rebuilt += pending[i];
+    }
+    fprintf(status, "%s changed in %d region(s): rebuilding %d of %d animation(s)\n", opts->input_path, dirty_count, rebuilt, manifest->count);
+    for (int i = 0; i < manifest->count; ++i) {
+        if (pending[i]) {
+            pending[i] = write_animation(ctx, *sheet, &manifest->anims[i], true, status) != EXIT_SUCCESS;
+        }
+    }
+    fflush(status);
+}
 
-    uint8_t *frame_buffer = (uint8_t *)malloc((size_t)frame_w * (size_t)frame_h * 4);
-    if (!frame_buffer) {
+// Rebuilds the animations of manifest from *sheet each time the input file is saved, until the
+// process is interrupted. Returns only if watching fails.
+static SpritechopExitCode watch_sheet(sc_context *ctx, const Options *opts, const Manifest *manifest, sc_sheet **sheet, sc_rect needed, FILE *status) {
+#ifdef __linux__
+    // Editors often save by renaming a new file over the old one, so the directory is watched
+    // for the file's name rather than the file itself.
+    const char *slash = strrchr(opts->input_path, '/');
+    const char *name = slash ? slash + 1 : opts->input_path;
+    char *dir = strdup(opts->input_path); // room for "." or "/" as well
+    bool *pending = (bool *)calloc((size_t)manifest->count, sizeof(bool));
+    if (!dir || !pending) {
+        free(pending);
+        free(dir);
         fprintf(stderr, "Memory allocation failed for frame buffer (exit code %d)\n", EXIT_FRAME_BUFFER_ALLOCATION_FAILED);
-        GifEnd(&writer);
-        stbi_image_free(img);
-        free(points);
         return EXIT_FRAME_BUFFER_ALLOCATION_FAILED;
     }
-    uint8_t *scaled_buffer = frame_buffer;
-    if (output_w != frame_w || output_h != frame_h) {
-        scaled_buffer = (uint8_t *)malloc((size_t)output_w * (size_t)output_h * 4);
-        if (!scaled_buffer) {
-            fprintf(stderr, "Memory allocation failed for scaled buffer (exit code %d)\n", EXIT_SCALED_BUFFER_ALLOCATION_FAILED);
-            free(frame_buffer);
-            GifEnd(&writer);
-            stbi_image_free(img);
-            free(points);
-            return EXIT_SCALED_BUFFER_ALLOCATION_FAILED;
+    if (!slash) {
+        strcpy(dir, ".");
+    } else if (slash == opts->input_path) {
+        strcpy(dir, "/");
+    } else {
+        dir[slash - opts->input_path] = '\0';
+    }
+
+    const int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        fprintf(stderr, "Failed to watch '%s': %s (exit code %d)\n", dir, strerror(errno), EXIT_WATCH_FAILED);
+        if (fd >= 0) {
+            close(fd);
         }
+        free(pending);
+        free(dir);
+        return EXIT_WATCH_FAILED;
     }
+    fprintf(status, "Watching %s for changes\n", opts->input_path);
+    fflush(status);
 
-    bool ok = true;
-    SpritechopExitCode exit_code = EXIT_SUCCESS;
-    for (int i = 0; i < frame_count; ++i) {
-        if (!copy_frame(frame_buffer, img, img_w, img_h, frame_w, frame_h, points[i])) {
-            fprintf(stderr, "Frame %d with origin (%d,%d) is out of bounds for image %dx%d (exit code %d)\n",
-                    i + 1, points[i].x, points[i].y, img_w, img_h, EXIT_FRAME_OUT_OF_BOUNDS);
-            ok = false;
-            exit_code = EXIT_FRAME_OUT_OF_BOUNDS;
+    union {
+        struct inotify_event event;
+        char bytes[4096];
+    } buffer;
+    for (;;) {
+        const ssize_t size = read(fd, buffer.bytes, sizeof(buffer.bytes));
+        if (size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (size <= 0) {
             break;
         }
+        bool saved = false;
+        for (ssize_t pos = 0; pos < size;) {
+            const struct inotify_event *event = (const struct inotify_event *)(buffer.bytes + pos);
+            saved = saved || (event->len > 0 && strcmp(event->name, name) == 0);
+            pos += (ssize_t)(sizeof(struct inotify_event) + event->len);
+        }
+        if (!saved) {
+            continue;
+        }
+        // A save can arrive as several events; wait until the directory has been quiet for
+        // 100 ms so that the sheet is only loaded once it is complete.
+        struct pollfd quiet = { fd, POLLIN, 0 };
+        while (poll(&quiet, 1, 100) > 0 && read(fd, buffer.bytes, sizeof(buffer.bytes)) > 0) {
+        }
+        rebuild_changed(ctx, opts, manifest, sheet, needed, pending, status);
+    }
+    fprintf(stderr, "Failed to watch '%s': %s (exit code %d)\n", dir, strerror(errno), EXIT_WATCH_FAILED);
+    close(fd);
+    free(pending);
+    free(dir);
+    return EXIT_WATCH_FAILED;
+#else
+    (void)ctx;
+    (void)manifest;
+    (void)sheet;
+    (void)needed;
+    (void)status;
+    (void)opts;
+    fprintf(stderr, "--watch needs inotify, which this system does not have (exit code %d)\n", EXIT_WATCH_FAILED);
+    return EXIT_WATCH_FAILED;
+#endif
+}
+
+// A server keeps decoded sheets between requests, dropping the least recently used ones once
+// they hold more than memory_limit bytes. An entry stays alive while requests use it, even
+// after it is evicted or its file changes and a newer version is loaded next to it.
+typedef struct SheetEntry {
+    char *path;
+    struct stat st; // of the file when it was loaded
+    sc_sheet *sheet;
+    size_t memory;
+    int users;
+    uint64_t last_used;
+    bool listed; // still in the cache, where later requests find it
+    struct SheetEntry *next;
+} SheetEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    SheetEntry *entries;
+    size_t memory; // held by listed entries
+    size_t memory_limit;
+    uint64_t clock;
+} SheetCache;
+
+static bool same_file(const struct stat *a, const struct stat *b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
 
-        uint8_t *frame_to_write = frame_buffer;
-        if (scaled_buffer != frame_buffer) {
-            resize_nearest(frame_buffer, frame_w, frame_h, scaled_buffer, output_w, output_h);
-            frame_to_write = scaled_buffer;
+static void free_sheet_entry(SheetEntry *entry) {
+    sc_sheet_free(entry->sheet);
+    free(entry->path);
+    free(entry);
+}
+
+// Takes entry out of the list; it is freed now if unused, otherwise by its last user.
+static void unlist_sheet_entry(SheetCache *cache, SheetEntry *entry) {
+    for (SheetEntry **link = &cache->entries; *link; link = &(*link)->next) {
+        if (*link == entry) {
+            *link = entry->next;
+            break;
         }
+    }
+    entry->listed = false;
+    cache->memory -= entry->memory;
+    if (entry->users == 0) {
+        free_sheet_entry(entry);
+    }
+}
 
-        if (transparency_color_set) {
-            apply_transparency_color(frame_to_write, output_w, output_h, transparency_r, transparency_g, transparency_b);
+// Evicts unused entries, least recently used first, until the cache fits its limit. Called
+// with the lock held.
+static void evict_sheets(SheetCache *cache) {
+    while (cache->memory > cache->memory_limit) {
+        SheetEntry *oldest = NULL;
+        for (SheetEntry *entry = cache->entries; entry; entry = entry->next) {
+            if (entry->users == 0 && (!oldest || entry->last_used < oldest->last_used)) {
+                oldest = entry;
+            }
         }
+        if (!oldest) {
+            break;
+        }
+        unlist_sheet_entry(cache, oldest);
+    }
+}
+
+// Finds the listed entry for the current version of the file at path, dropping older ones.
+// Called with the lock held.
+static SheetEntry *find_sheet(SheetCache *cache, const char *path, const struct stat *st) {
+    for (SheetEntry *entry = cache->entries; entry; entry = entry->next) {
+        if (strcmp(entry->path, path) != 0) {
+            continue;
+        }
+        if (same_file(&entry->st, st)) {
+            return entry;
+        }
+        unlist_sheet_entry(cache, entry);
+        break;
+    }
+    return NULL;
+}
+
+// Returns the sheet at path for one request, loading it with ctx unless the cache holds the
+// current version of the file. Sheets are loaded whole, so that every request can use them,
+// and outside the lock, so that other requests carry on meanwhile.
+static SheetEntry *acquire_sheet(SheetCache *cache, sc_context *ctx, const char *path, FILE *err) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        fprintf(err, "Failed to load image '%s': %s (exit code %d)\n", path, strerror(errno), EXIT_IMAGE_LOAD_FAILED);
+        return NULL;
+    }
+    pthread_mutex_lock(&cache->lock);
+    SheetEntry *entry = find_sheet(cache, path, &st);
+    if (entry) {
+        ++entry->users;
+        entry->last_used = ++cache->clock;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if (entry) {
+        return entry;
+    }
+
+    sc_sheet *sheet = NULL;
+    if (sc_sheet_load(ctx, path, NULL, &sheet) != SC_OK) {
+        fprintf(err, "Failed to load image '%s': %s (exit code %d)\n", path, sc_context_error(ctx), EXIT_IMAGE_LOAD_FAILED);
+        return NULL;
+    }
+    entry = (SheetEntry *)calloc(1, sizeof(SheetEntry));
+    if (entry) {
+        entry->path = strdup(path);
+    }
+    if (!entry || !entry->path) {
+        free(entry);
+        sc_sheet_free(sheet);
+        fprintf(err, "Memory allocation failed for sheet (exit code %d)\n", EXIT_FRAME_BUFFER_ALLOCATION_FAILED);
+        return NULL;
+    }
+    entry->st = st;
+    entry->sheet = sheet;
+    entry->memory = sc_sheet_memory(sheet);
+    entry->users = 1;
+
+    pthread_mutex_lock(&cache->lock);
+    SheetEntry *loaded = find_sheet(cache, path, &st); // by another request meanwhile
+    if (loaded) {
+        ++loaded->users;
+        loaded->last_used = ++cache->clock;
+    } else {
+        entry->listed = true;
+        entry->last_used = ++cache->clock;
+        entry->next = cache->entries;
+        cache->entries = entry;
+        cache->memory += entry->memory;
+        evict_sheets(cache);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if (loaded) {
+        free_sheet_entry(entry);
+        return loaded;
+    }
+    return entry;
+}
+
+static void release_sheet(SheetCache *cache, SheetEntry *entry) {
+    pthread_mutex_lock(&cache->lock);
+    --entry->users;
+    if (!entry->listed && entry->users == 0) {
+        free_sheet_entry(entry);
+    } else {
+        evict_sheets(cache);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Longest request line a server accepts. A client that sends more without a newline is
+// answered with an error and disconnected.
+#define MAX_REQUEST_LINE 65536
+// Seconds a worker waits for a client that stops reading its answer before giving up on it.
+#define CLIENT_SEND_TIMEOUT 10
+
+// A client connection. While it is idle the dispatcher reads what the client sends into
+// received, and once a whole request line has arrived it queues the connection for a worker,
+// which answers that one line and hands it back. So workers are only ever busy with requests,
+// never with clients that keep a connection open without sending anything.
+typedef struct Connection {
+    int fd;
+    char *received; // bytes read but not yet answered, at most MAX_REQUEST_LINE
+    size_t received_size;
+    bool too_long; // received is full without a newline
+    bool hung_up;  // the client will send nothing more
+    bool closing;  // answered for the last time
+    struct Connection *next; // in the server's queue or returned list
+} Connection;
+
+typedef struct {
+    int listener;
+    int wake[2]; // written to when a worker returns a connection, to wake the dispatcher
+    SheetCache sheets;
+    const Options *defaults;
+    pthread_mutex_t lock; // guards the lists below
+    pthread_cond_t queued;
+    Connection *queue; // holding a request, oldest first
+    Connection *queue_tail;
+    Connection *returned; // answered, for the dispatcher to take back
+} Server;
+
+typedef struct {
+    Server *server;
+    sc_context *ctx;
+} ServeWorker;
+
+// Cuts the GIF one request line asks for into *gif, reporting failures to err.
+static SpritechopExitCode handle_request(Server *server, sc_context *ctx, char *line, FILE *err, uint8_t **gif, size_t *gif_size) {
+    int token_count = 0;
+    int token_capacity = 0;
+    char **tokens = NULL;
+    char *save = NULL;
+    for (char *tok = strtok_r(line, " \t\r\n", &save); tok; tok = strtok_r(NULL, " \t\r\n", &save)) {
+        char **grown = (char **)grow_array(tokens, &token_capacity, token_count + 1, sizeof(char *));
+        if (!grown) {
+            free(tokens);
+            fprintf(err, "Memory allocation failed for request (exit code %d)\n", EXIT_POINTS_ALLOCATION_FAILED);
+            return EXIT_POINTS_ALLOCATION_FAILED;
+        }
+        tokens = grown;
+        tokens[token_count++] = tok;
+    }
+
+    // Options given when the server was started are defaults for every request.
+    Options opts = *server->defaults;
+    opts.input_path = NULL;
+    opts.anim.output_path = "-";
+    int argi = 0;
+    SpritechopExitCode exit_code = parse_options(token_count, tokens, &argi, &opts, OPTIONS_REQUEST, err, NULL);
+    if (exit_code == EXIT_SUCCESS && !opts.input_path) {
+        fprintf(err, "Input image is required (-i) (exit code %d)\n", EXIT_INPUT_REQUIRED);
+        exit_code = EXIT_INPUT_REQUIRED;
+    }
+    if (exit_code == EXIT_SUCCESS && is_stdio_path(opts.input_path)) {
+        fprintf(err, "A server cannot read the input image from stdin (exit code %d)\n", EXIT_STDIO_CONFLICT);
+        exit_code = EXIT_STDIO_CONFLICT;
+    }
+    if (exit_code == EXIT_SUCCESS) {
+        exit_code = finish_animation(&opts.anim, token_count - argi, tokens + argi, err, NULL);
+    }
+    SheetEntry *entry = NULL;
+    if (exit_code == EXIT_SUCCESS) {
+        entry = acquire_sheet(&server->sheets, ctx, opts.input_path, err);
+        exit_code = entry ? EXIT_SUCCESS : EXIT_IMAGE_LOAD_FAILED;
+    }
+    if (exit_code == EXIT_SUCCESS) {
+        const sc_animation anim = to_sc_animation(&opts.anim);
+        const sc_status status = sc_encode_gif_to_buffer(ctx, entry->sheet, &anim, gif, gif_size, NULL);
+        if (status != SC_OK) {
+            exit_code = report_failure(ctx, status, &opts.anim, err);
+        }
+    }
+    if (entry) {
+        release_sheet(&server->sheets, entry);
+    }
+    free(opts.anim.points);
+    free(tokens);
+    return exit_code;
+}
+
+static bool write_all(int fd, const void *data, size_t size) {
+    const uint8_t *p = (const uint8_t *)data;
+    while (size > 0) {
+        const ssize_t written = write(fd, p, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        p += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+static bool has_request(const Connection *conn) {
+    return conn->too_long || (conn->received_size > 0 && memchr(conn->received, '\n', conn->received_size) != NULL);
+}
+
+static void close_connection(Connection *conn) {
+    close(conn->fd);
+    free(conn->received);
+    free(conn);
+}
+
+// Answers the first line conn has received and drops it from conn->received. A request is the
+// command line options and coordinates of one GIF, without -o; the answer is "OK <size>\n"
+// followed by the GIF, or "ERROR <exit code> <size>\n" followed by the error message. Blank
+// lines get no answer.
+static void answer_request(Server *server, sc_context *ctx, Connection *conn) {
+    char *line = conn->received;
+    size_t line_size = conn->received_size;
+    if (!conn->too_long) {
+        char *newline = (char *)memchr(line, '\n', line_size);
+        *newline = '\0';
+        line_size = (size_t)(newline - line) + 1;
+        if (strspn(line, " \t\r") == line_size - 1) {
+            conn->received_size -= line_size;
+            memmove(conn->received, conn->received + line_size, conn->received_size);
+            return;
+        }
+    }
+
+    char *message = NULL;
+    size_t message_size = 0;
+    FILE *err = open_memstream(&message, &message_size);
+    uint8_t *gif = NULL;
+    size_t gif_size = 0;
+    SpritechopExitCode exit_code = EXIT_POINTS_ALLOCATION_FAILED;
+    if (err && conn->too_long) {
+        // the rest of the line is still to come, so nothing after it can be told apart
+        fprintf(err, "Request line is longer than %d bytes (exit code %d)\n", MAX_REQUEST_LINE, EXIT_REQUEST_TOO_LONG);
+        exit_code = EXIT_REQUEST_TOO_LONG;
+        conn->closing = true;
+    } else if (err) {
+        exit_code = handle_request(server, ctx, line, err, &gif, &gif_size);
+    }
+    if (err) {
+        fclose(err);
+    }
+    conn->received_size -= line_size;
+    memmove(conn->received, conn->received + line_size, conn->received_size);
+
+    char header[64];
+    bool sent;
+    if (exit_code == EXIT_SUCCESS) {
+        snprintf(header, sizeof(header), "OK %zu\n", gif_size);
+        sent = write_all(conn->fd, header, strlen(header)) && write_all(conn->fd, gif, gif_size);
+    } else {
+        const size_t size = message ? message_size : 0;
+        snprintf(header, sizeof(header), "ERROR %d %zu\n", (int)exit_code, size);
+        sent = write_all(conn->fd, header, strlen(header)) && write_all(conn->fd, message, size);
+    }
+    conn->closing = conn->closing || !sent;
+    sc_free(gif);
+    free(message);
+}
+
+static void queue_connection(Server *server, Connection *conn) {
+    conn->next = NULL;
+    pthread_mutex_lock(&server->lock);
+    if (server->queue_tail) {
+        server->queue_tail->next = conn;
+    } else {
+        server->queue = conn;
+    }
+    server->queue_tail = conn;
+    pthread_cond_signal(&server->queued);
+    pthread_mutex_unlock(&server->lock);
+}
+
+static void *serve_worker(void *arg) {
+    ServeWorker *worker = (ServeWorker *)arg;
+    Server *server = worker->server;
+    for (;;) {
+        pthread_mutex_lock(&server->lock);
+        while (!server->queue) {
+            pthread_cond_wait(&server->queued, &server->lock);
+        }
+        Connection *conn = server->queue;
+        server->queue = conn->next;
+        if (!server->queue) {
+            server->queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&server->lock);
+
+        answer_request(server, worker->ctx, conn);
+
+        pthread_mutex_lock(&server->lock);
+        conn->next = server->returned;
+        server->returned = conn;
+        pthread_mutex_unlock(&server->lock);
+        const char wake = 0;
+        if (write(server->wake[1], &wake, 1) < 0) {
+            // the pipe is full, so the dispatcher is due to wake up anyway
+        }
+    }
+    return NULL;
+}
+
+// Reads what the client has sent into conn->received, without passing MAX_REQUEST_LINE bytes.
+// At the end of the stream a last line without a newline is completed, as getline() would.
+static void receive_request(Connection *conn) {
+    char chunk[4096];
+    const size_t room = MAX_REQUEST_LINE - conn->received_size;
+    ssize_t got = recv(conn->fd, chunk, room < sizeof(chunk) ? room : sizeof(chunk), 0);
+    if (got < 0 && errno == EINTR) {
+        return;
+    }
+    if (got <= 0) {
+        conn->hung_up = true;
+        if (conn->received_size == 0 || has_request(conn)) {
+            return;
+        }
+        chunk[0] = '\n';
+        got = 1;
+    }
+    char *grown = (char *)realloc(conn->received, conn->received_size + (size_t)got);
+    if (!grown) {
+        conn->hung_up = true;
+        conn->received_size = 0;
+        return;
+    }
+    memcpy(grown + conn->received_size, chunk, (size_t)got);
+    conn->received = grown;
+    conn->received_size += (size_t)got;
+    conn->too_long = conn->received_size == MAX_REQUEST_LINE && !has_request(conn);
+}
+
+// Accepts connections and watches every idle one for requests, handing each connection to the
+// workers once it holds a whole request line. Runs until the process exits.
+static void *serve_dispatcher(void *arg) {
+    Server *server = (Server *)arg;
+    Connection **idle = NULL;
+    int idle_count = 0;
+    int idle_capacity = 0;
+    struct pollfd *fds = NULL;
+    int fds_capacity = 0;
+    for (;;) {
+        char drained[64];
+        while (read(server->wake[0], drained, sizeof(drained)) > 0) {
+        }
+        pthread_mutex_lock(&server->lock);
+        Connection *returned = server->returned;
+        server->returned = NULL;
+        pthread_mutex_unlock(&server->lock);
+        while (returned) {
+            Connection *conn = returned;
+            returned = conn->next;
+            Connection **grown = (Connection **)grow_array(idle, &idle_capacity, idle_count + 1, sizeof(Connection *));
+            if (!grown || conn->closing || (conn->hung_up && !has_request(conn))) {
+                close_connection(conn);
+                continue;
+            }
+            idle = grown;
+            idle[idle_count++] = conn;
+        }
+        for (int i = idle_count - 1; i >= 0; --i) {
+            if (has_request(idle[i])) {
+                queue_connection(server, idle[i]);
+                idle[i] = idle[--idle_count];
+            } else if (idle[i]->hung_up) {
+                close_connection(idle[i]);
+                idle[i] = idle[--idle_count];
+            }
+        }
+
+        struct pollfd *grown = (struct pollfd *)grow_array(fds, &fds_capacity, idle_count + 2, sizeof(struct pollfd));
+        if (!grown) {
+            fprintf(stderr, "Memory allocation failed for connections\n");
+            break;
+        }
+        fds = grown;
+        fds[0] = (struct pollfd){ .fd = server->listener, .events = POLLIN };
+        fds[1] = (struct pollfd){ .fd = server->wake[0], .events = POLLIN };
+        for (int i = 0; i < idle_count; ++i) {
+            fds[i + 2] = (struct pollfd){ .fd = idle[i]->fd, .events = POLLIN };
+        }
+        const int polled = idle_count;
+        if (poll(fds, (nfds_t)polled + 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Failed to wait for requests: %s\n", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < polled; ++i) {
+            if (fds[i + 2].revents) {
+                receive_request(idle[i]);
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            const int fd = accept(server->listener, NULL, NULL);
+            Connection *conn = fd >= 0 ? (Connection *)calloc(1, sizeof(Connection)) : NULL;
+            Connection **grown_idle = conn ? (Connection **)grow_array(idle, &idle_capacity, idle_count + 1, sizeof(Connection *)) : NULL;
+            if (grown_idle) {
+                const struct timeval timeout = { CLIENT_SEND_TIMEOUT, 0 };
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                conn->fd = fd;
+                idle = grown_idle;
+                idle[idle_count++] = conn;
+            } else if (fd >= 0) {
+                free(conn);
+                close(fd);
+            } else if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN) {
+                fprintf(stderr, "Failed to accept a connection: %s\n", strerror(errno));
+            }
+        }
+    }
+    free(fds);
+    for (int i = 0; i < idle_count; ++i) {
+        close_connection(idle[i]);
+    }
+    free(idle);
+    return NULL;
+}
+
+// Serves requests on a Unix socket at opts->serve_path until SIGINT or SIGTERM: a dispatcher
+// thread reads requests from every connection, and opts->jobs worker threads each answer one
+// request at a time.
+static SpritechopExitCode run_server(const Options *opts) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(opts->serve_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path is too long: %s (exit code %d)\n", opts->serve_path, EXIT_SERVE_FAILED);
+        return EXIT_SERVE_FAILED;
+    }
+    strcpy(addr.sun_path, opts->serve_path);
+
+    int jobs = opts->jobs;
+    if (jobs == 0) {
+        const long online = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = online > 0 ? (int)online : 1;
+    }
+    Server server;
+    memset(&server, 0, sizeof(server));
+    server.defaults = opts;
+    server.sheets.memory_limit = opts->sheet_memory;
+    pthread_mutex_init(&server.sheets.lock, NULL);
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.queued, NULL);
 
-        if (!GifWriteFrame(&writer, frame_to_write, (uint32_t)output_w, (uint32_t)output_h, delay_cs, 8, false)) {
-            fprintf(stderr, "Failed to write frame %d (exit code %d)\n", i + 1, EXIT_WRITE_FRAME_FAILED);
-            ok = false;
-            exit_code = EXIT_WRITE_FRAME_FAILED;
+    ServeWorker *workers = (ServeWorker *)calloc((size_t)jobs, sizeof(ServeWorker));
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * (size_t)jobs);
+    SpritechopExitCode exit_code = EXIT_SUCCESS;
+    if (!workers || !threads) {
+        fprintf(stderr, "Memory allocation failed for frame buffer (exit code %d)\n", EXIT_FRAME_BUFFER_ALLOCATION_FAILED);
+        exit_code = EXIT_FRAME_BUFFER_ALLOCATION_FAILED;
+    }
+    for (int t = 0; exit_code == EXIT_SUCCESS && t < jobs; ++t) {
+        workers[t].server = &server;
+        workers[t].ctx = sc_context_create(1);
+        if (!workers[t].ctx) {
+            fprintf(stderr, "Memory allocation failed for frame buffer (exit code %d)\n", EXIT_FRAME_BUFFER_ALLOCATION_FAILED);
+            exit_code = EXIT_FRAME_BUFFER_ALLOCATION_FAILED;
+        } else if (opts->cache_dir && sc_context_set_cache(workers[t].ctx, opts->cache_dir) != SC_OK) {
+            fprintf(stderr, "%s (exit code %d)\n", sc_context_error(workers[t].ctx), EXIT_CACHE_DIR_FAILED);
+            exit_code = EXIT_CACHE_DIR_FAILED;
+        }
+    }
+
+    // A socket left behind by a server that was killed is replaced; any other file is not.
+    server.listener = -1;
+    server.wake[0] = server.wake[1] = -1;
+    if (exit_code == EXIT_SUCCESS) {
+        struct stat st;
+        if (lstat(opts->serve_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(opts->serve_path);
+        }
+        server.listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (server.listener < 0 || bind(server.listener, (const struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(server.listener, SOMAXCONN) != 0) {
+            fprintf(stderr, "Failed to listen on '%s': %s (exit code %d)\n", opts->serve_path, strerror(errno), EXIT_SERVE_FAILED);
+            exit_code = EXIT_SERVE_FAILED;
+        } else if (pipe(server.wake) != 0 || fcntl(server.wake[0], F_SETFL, O_NONBLOCK) != 0 ||
+                   fcntl(server.wake[1], F_SETFL, O_NONBLOCK) != 0 || fcntl(server.listener, F_SETFL, O_NONBLOCK) != 0) {
+            fprintf(stderr, "Failed to set up the server: %s (exit code %d)\n", strerror(errno), EXIT_SERVE_FAILED);
+            exit_code = EXIT_SERVE_FAILED;
+        }
+    }
+
+    // Clients that hang up early must not kill the server, and only this thread takes the
+    // signals that stop it.
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    if (exit_code == EXIT_SUCCESS) {
+        struct sigaction ignore;
+        memset(&ignore, 0, sizeof(ignore));
+        ignore.sa_handler = SIG_IGN;
+        sigaction(SIGPIPE, &ignore, NULL);
+        pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+    }
+    int threads_started = 0;
+    for (; exit_code == EXIT_SUCCESS && threads_started < jobs; ++threads_started) {
+        if (pthread_create(&threads[threads_started], NULL, serve_worker, &workers[threads_started]) != 0) {
             break;
         }
     }
+    pthread_t dispatcher;
+    if (exit_code == EXIT_SUCCESS && (threads_started == 0 || pthread_create(&dispatcher, NULL, serve_dispatcher, &server) != 0)) {
+        fprintf(stderr, "Failed to start server threads (exit code %d)\n", EXIT_WORKER_START_FAILED);
+        exit_code = EXIT_WORKER_START_FAILED;
+    }
+    if (exit_code == EXIT_SUCCESS) {
+        printf("Serving on %s with %d worker(s)\n", opts->serve_path, threads_started);
+        fflush(stdout);
+        int signal_number;
+        sigwait(&stop_signals, &signal_number);
+        // The dispatcher and workers never return, so the process exits without joining them.
+        unlink(opts->serve_path);
+        exit(EXIT_SUCCESS);
+    }
+
+    if (server.listener >= 0) {
+        close(server.listener);
+    }
+    for (int i = 0; i < 2; ++i) {
+        if (server.wake[i] >= 0) {
+            close(server.wake[i]);
+        }
+    }
+    for (int t = 0; workers && t < jobs; ++t) {
+        sc_context_destroy(workers[t].ctx);
+    }
+    free(threads);
+    free(workers);
+    pthread_mutex_destroy(&server.sheets.lock);
+    pthread_mutex_destroy(&server.lock);
+    pthread_cond_destroy(&server.queued);
+    return exit_code;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "No arguments provided (exit code %d)\n", EXIT_ARGS_MISSING);
+        usage(argv[0]);
+        return EXIT_ARGS_MISSING;
+    }
+
+    Options opts = {0};
+    opts.jobs = 1;
+    opts.sheet_memory = (size_t)256 << 20;
+    opts.anim.delay_cs = 8; // default to 80 ms per frame
+
+    int argi = 1;
+    SpritechopExitCode exit_code = parse_options(argc, argv, &argi, &opts, OPTIONS_COMMAND_LINE, stderr, argv[0]);
+    if (exit_code != EXIT_SUCCESS) {
+        return exit_code;
+    }
+
+    if (opts.serve_path) {
+        if (opts.input_path || opts.manifest_path || opts.key_sheet || opts.watch || argi < argc) {
+            fprintf(stderr, "--serve cannot be combined with -i, --manifest, --key-sheet, --watch or coordinates; each request names its own input and frames (exit code %d)\n", EXIT_SERVE_CONFLICT);
+            usage(argv[0]);
+            return EXIT_SERVE_CONFLICT;
+        }
+        return run_server(&opts);
+    }
+
+    if (!opts.input_path) {
+        fprintf(stderr, "Input image is required (-i) (exit code %d)\n", EXIT_INPUT_REQUIRED);
+        usage(argv[0]);
+        return EXIT_INPUT_REQUIRED;
+    }
 
-    GifEnd(&writer);
-    stbi_image_free(img);
-    if (scaled_buffer != frame_buffer) {
-        free(scaled_buffer);
+    if (opts.manifest_path && is_stdio_path(opts.manifest_path) && is_stdio_path(opts.input_path)) {
+        fprintf(stderr, "The input image and the manifest cannot both be read from stdin (exit code %d)\n", EXIT_STDIO_CONFLICT);
+        usage(argv[0]);
+        return EXIT_STDIO_CONFLICT;
     }
-    free(frame_buffer);
-    free(points);
 
-    if (!ok) {
-        remove(output_path);
+    Manifest manifest = {0};
+    if (opts.manifest_path) {
+        if (argi < argc) {
+            fprintf(stderr, "Coordinates must be listed in the manifest when --manifest is used: %s (exit code %d)\n", argv[argi], EXIT_INVALID_COORDINATE_VALUE);
+            usage(argv[0]);
+            return EXIT_INVALID_COORDINATE_VALUE;
+        }
+        // Command-line -s/-so/-f/-t act as defaults; every line names its own output.
+        opts.anim.output_path = NULL;
+        exit_code = load_manifest(opts.manifest_path, &opts.anim, &manifest, argv[0]);
+    } else {
+        exit_code = finish_animation(&opts.anim, argc - argi, argv + argi, stderr, argv[0]);
+        manifest.anims = &opts.anim;
+        manifest.count = 1;
+    }
+    if (exit_code != EXIT_SUCCESS) {
         return exit_code;
     }
 
-    printf("Wrote %d frame(s) to %s (%dx%d)\n", frame_count, output_path, output_w, output_h);
-    return EXIT_SUCCESS;
+    // Keying the shared sheet once only works if every animation uses the same color.
+    for (int i = 0; opts.key_sheet && i < manifest.count; ++i) {
+        const Animation *anim = &manifest.anims[i];
+        if (!opts.anim.transparency_color_set || !anim->transparency_color_set ||
+            anim->transparency_r != opts.anim.transparency_r || anim->transparency_g != opts.anim.transparency_g ||
+            anim->transparency_b != opts.anim.transparency_b) {
+            fprintf(stderr, "--key-sheet requires every animation to use the -t color given on the command line (exit code %d)\n", EXIT_KEY_SHEET_CONFLICT);
+            usage(argv[0]);
+            exit_code = EXIT_KEY_SHEET_CONFLICT;
+            break;
+        }
+    }
+    // Only one GIF can go to stdout, and then nothing else may.
+    FILE *status = stdout;
+    for (int i = 0; exit_code == EXIT_SUCCESS && i < manifest.count; ++i) {
+        if (!is_stdio_path(manifest.anims[i].output_path)) {
+            continue;
+        }
+        if (status == stderr) {
+            fprintf(stderr, "Only one animation can be written to stdout (exit code %d)\n", EXIT_STDIO_CONFLICT);
+            usage(argv[0]);
+            exit_code = EXIT_STDIO_CONFLICT;
+        }
+        status = stderr;
+    }
+    // A watched sheet is loaded again on every save, and its GIFs are replaced by renaming new
+    // files over them.
+    if (exit_code == EXIT_SUCCESS && opts.watch && (is_stdio_path(opts.input_path) || status == stderr)) {
+        fprintf(stderr, "--watch needs the input image and every output to be files (exit code %d)\n", EXIT_WATCH_CONFLICT);
+        usage(argv[0]);
+        exit_code = EXIT_WATCH_CONFLICT;
+    }
+    if (exit_code != EXIT_SUCCESS) {
+        if (opts.manifest_path) {
+            free_manifest(&manifest);
+        } else {
+            free(opts.anim.points);
+        }
+        return exit_code;
+    }
+
+    sc_context *ctx = sc_context_create(opts.jobs);
+    const sc_rect needed = frames_bounding_box(&manifest);
+    sc_sheet *sheet = NULL;
+    if (ctx) {
+        // A one-shot run frees the sheet before the file can change, so it may read the file in
+        // place. A watched sheet is kept across saves and diffed against the next load, so it
+        // needs its own copy of the pixels.
+        sc_context_set_file_backed(ctx, !opts.watch);
+    }
+    if (!ctx) {
+        fprintf(stderr, "Memory allocation failed for frame buffer (exit code %d)\n", EXIT_FRAME_BUFFER_ALLOCATION_FAILED);
+        exit_code = EXIT_FRAME_BUFFER_ALLOCATION_FAILED;
+    } else if (opts.cache_dir && sc_context_set_cache(ctx, opts.cache_dir) != SC_OK) {
+        fprintf(stderr, "%s (exit code %d)\n", sc_context_error(ctx), EXIT_CACHE_DIR_FAILED);
+        exit_code = EXIT_CACHE_DIR_FAILED;
+    } else if (sc_sheet_load(ctx, opts.input_path, &needed, &sheet) != SC_OK) {
+        fprintf(stderr, "Failed to load image '%s': %s (exit code %d)\n", is_stdio_path(opts.input_path) ? "stdin" : opts.input_path, sc_context_error(ctx), EXIT_IMAGE_LOAD_FAILED);
+        exit_code = EXIT_IMAGE_LOAD_FAILED;
+    } else {
+        // Only a sheet decoded to RGBA can be keyed in place; otherwise frames are keyed instead.
+        if (opts.key_sheet) {
+            sc_sheet_apply_key(sheet, opts.anim.transparency_r, opts.anim.transparency_g, opts.anim.transparency_b);
+        }
+        for (int i = 0; i < manifest.count && exit_code == EXIT_SUCCESS; ++i) {
+            exit_code = write_animation(ctx, sheet, &manifest.anims[i], false, status);
+        }
+        if (exit_code == EXIT_SUCCESS && opts.watch) {
+            exit_code = watch_sheet(ctx, &opts, &manifest, &sheet, needed, status);
+        }
+        sc_sheet_free(sheet);
+    }
+    sc_context_destroy(ctx);
+
+    if (opts.manifest_path) {
+        free_manifest(&manifest);
+    } else {
+        free(opts.anim.points);
+    }
+    return exit_code;
 }
@@ -0,0 +1,460 @@
+// check.c - checks libspritechop against stb_image, run by `make check`.
+//
+// PNGs of every filter type and colour type the region decoder handles are written here, with
+// stored or fixed-Huffman deflate blocks and IDAT split or whole, and a region of each is
+// decoded and compared with the same pixels from stbi_load. GIFs are then checked to come out
+// byte for byte the same whatever the number of encoding threads and whether the frame cache
+// is cold or warm, and one GIF is decoded again with stb_image's GIF decoder.
+//
+// `check --write-sheet FILE` only writes the sheet the GIF checks use, for tests/check.sh.
+
+#define _XOPEN_SOURCE 700
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../include/spritechop.h"
+#include "../include/stb_image.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        ++failures;
+    }
+}
+
+// Growable byte buffer the PNGs are written to.
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    uint32_t bits;  // pending deflate bits, least significant first
+    int bit_count;
+} Buffer;
+
+static void put(Buffer *b, const void *data, size_t size) {
+    if (b->size + size > b->capacity) {
+        b->capacity = (b->size + size) * 2;
+        b->data = (uint8_t *)realloc(b->data, b->capacity);
+        if (!b->data) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+}
+
+static void put_byte(Buffer *b, uint8_t v) {
+    put(b, &v, 1);
+}
+
+static void put_be32(Buffer *b, uint32_t v) {
+    const uint8_t bytes[4] = { (uint8_t)(v >> 24), (uint8_t)(v >> 16), (uint8_t)(v >> 8), (uint8_t)v };
+    put(b, bytes, 4);
+}
+
+static void put_bits(Buffer *b, uint32_t v, int count) {
+    b->bits |= v << b->bit_count;
+    b->bit_count += count;
+    while (b->bit_count >= 8) {
+        put_byte(b, (uint8_t)b->bits);
+        b->bits >>= 8;
+        b->bit_count -= 8;
+    }
+}
+
+// Huffman codes are sent most significant bit first.
+static void put_code(Buffer *b, uint32_t code, int length) {
+    uint32_t reversed = 0;
+    for (int i = 0; i < length; ++i) {
+        reversed |= ((code >> i) & 1) << (length - 1 - i);
+    }
+    put_bits(b, reversed, length);
+}
+
+static void flush_bits(Buffer *b) {
+    if (b->bit_count > 0) {
+        put_bits(b, 0, 8 - b->bit_count);
+    }
+}
+
+static uint32_t crc32(const uint8_t *data, size_t size) {
+    uint32_t crc = 0xffffffffu;
+    for (size_t i = 0; i < size; ++i) {
+        crc ^= data[i];
+        for (int k = 0; k < 8; ++k) {
+            crc = (crc >> 1) ^ (0xedb88320u & (0u - (crc & 1)));
+        }
+    }
+    return crc ^ 0xffffffffu;
+}
+
+static uint32_t adler32(const uint8_t *data, size_t size) {
+    uint32_t a = 1, b = 0;
+    for (size_t i = 0; i < size; ++i) {
+        a = (a + data[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    return (b << 16) | a;
+}
+
+static void put_chunk(Buffer *png, const char *type, const uint8_t *body, size_t size) {
+    put_be32(png, (uint32_t)size);
+    const size_t start = png->size;
+    put(png, type, 4);
+    if (size > 0) {
+        put(png, body, size);
+    }
+    put_be32(png, crc32(png->data + start, size + 4));
+}
+
+// A zlib stream of literals only, in blocks of at most block_size bytes, stored or with the
+// fixed Huffman code.
+static Buffer deflate(const uint8_t *data, size_t size, size_t block_size, bool stored) {
+    Buffer z = { 0 };
+    put_byte(&z, 0x78);
+    put_byte(&z, 0x01);
+    size_t pos = 0;
+    do {
+        const size_t n = size - pos < block_size ? size - pos : block_size;
+        const bool last = pos + n == size;
+        if (stored) {
+            put_bits(&z, last ? 1 : 0, 3);
+            flush_bits(&z);
+            const uint8_t header[4] = { (uint8_t)n, (uint8_t)(n >> 8), (uint8_t)~n, (uint8_t)(~n >> 8) };
+            put(&z, header, 4);
+            put(&z, data + pos, n);
+        } else {
+            put_bits(&z, last ? 3 : 2, 3);
+            for (size_t i = 0; i < n; ++i) {
+                const uint8_t v = data[pos + i];
+                if (v < 144) {
+                    put_code(&z, 0x30 + v, 8);
+                } else {
+                    put_code(&z, 0x190 + (v - 144), 9);
+                }
+            }
+            put_code(&z, 0, 7); // end of block
+        }
+        pos += n;
+    } while (pos < size);
+    flush_bits(&z);
+    put_be32(&z, adler32(data, size));
+    return z;
+}
+
+static int paeth(int a, int b, int c) {
+    const int p = a + b - c;
+    const int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// How a test image is written. filter -1 cycles through all five filters row by row.
+typedef struct {
+    const char *name;
+    int color_type; // 0 gray, 2 RGB, 3 palette
+    bool trns;
+    int filter;
+    bool stored;
+    size_t idat_size; // IDAT chunks are split after this many bytes; 0 keeps one chunk
+} PngCase;
+
+static int png_channels(int color_type) {
+    return color_type == 2 ? 3 : 1;
+}
+
+// Writes a w x h PNG whose samples are a fixed function of their position, so every filter
+// has something to predict.
+static Buffer write_png(const PngCase *c, int w, int h) {
+    const int channels = png_channels(c->color_type);
+    const size_t row_size = (size_t)w * (size_t)channels;
+    uint8_t *raw = (uint8_t *)malloc(row_size * (size_t)h);
+    uint8_t *filtered = (uint8_t *)malloc((row_size + 1) * (size_t)h);
+    if (!raw || !filtered) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            for (int k = 0; k < channels; ++k) {
+                raw[(size_t)y * row_size + (size_t)x * channels + k] =
+                    c->color_type == 3 ? (uint8_t)((x / 3 + y / 5 * 7) % 200)
+                                       : (uint8_t)(x * (k + 1) + y * 3 + ((x * y) >> 4) * k);
+            }
+        }
+    }
+    for (int y = 0; y < h; ++y) {
+        const uint8_t *cur = raw + (size_t)y * row_size;
+        const uint8_t *prior = y > 0 ? cur - row_size : NULL;
+        uint8_t *out = filtered + (size_t)y * (row_size + 1);
+        const int filter = c->filter >= 0 ? c->filter : y % 5;
+        out[0] = (uint8_t)filter;
+        for (size_t i = 0; i < row_size; ++i) {
+            const int left = i >= (size_t)channels ? cur[i - channels] : 0;
+            const int up = prior ? prior[i] : 0;
+            const int up_left = prior && i >= (size_t)channels ? prior[i - channels] : 0;
+            const int predicted = filter == 1 ? left
+                                : filter == 2 ? up
+                                : filter == 3 ? (left + up) / 2
+                                : filter == 4 ? paeth(left, up, up_left)
+                                              : 0;
+            out[1 + i] = (uint8_t)(cur[i] - predicted);
+        }
+    }
+
+    Buffer png = { 0 };
+    static const uint8_t signature[8] = { 137, 'P', 'N', 'G', 13, 10, 26, 10 };
+    put(&png, signature, 8);
+    const uint8_t ihdr[13] = {
+        (uint8_t)(w >> 24), (uint8_t)(w >> 16), (uint8_t)(w >> 8), (uint8_t)w,
+        (uint8_t)(h >> 24), (uint8_t)(h >> 16), (uint8_t)(h >> 8), (uint8_t)h,
+        8, (uint8_t)c->color_type, 0, 0, 0,
+    };
+    put_chunk(&png, "IHDR", ihdr, sizeof(ihdr));
+    if (c->color_type == 3) {
+        uint8_t plte[200 * 3], trns[200];
+        for (int i = 0; i < 200; ++i) {
+            plte[i * 3 + 0] = (uint8_t)(i * 37);
+            plte[i * 3 + 1] = (uint8_t)(i * 11 + 5);
+            plte[i * 3 + 2] = (uint8_t)(255 - i);
+            trns[i] = (uint8_t)(i % 3 == 0 ? 0 : i);
+        }
+        put_chunk(&png, "PLTE", plte, sizeof(plte));
+        if (c->trns) {
+            put_chunk(&png, "tRNS", trns, sizeof(trns) / 2);
+        }
+    } else if (c->trns) {
+        // the color of the first pixel, so that some pixels are keyed
+        const uint8_t trns[6] = { 0, raw[0], 0, channels > 1 ? raw[1] : 0, 0, channels > 2 ? raw[2] : 0 };
+        put_chunk(&png, "tRNS", trns, (size_t)channels * 2);
+    }
+    Buffer z = deflate(filtered, (row_size + 1) * (size_t)h, c->stored ? 65535 : 16384, c->stored);
+    const size_t step = c->idat_size ? c->idat_size : z.size;
+    for (size_t pos = 0; pos < z.size; pos += step) {
+        put_chunk(&png, "IDAT", z.data + pos, z.size - pos < step ? z.size - pos : step);
+    }
+    put_chunk(&png, "IEND", NULL, 0);
+    free(z.data);
+    free(raw);
+    free(filtered);
+    return png;
+}
+
+// Cuts region out of the sheet as one frame and compares it with the same pixels of expected,
+// an RGBA image of width w.
+static bool region_matches(sc_context *ctx, const sc_sheet *sheet, sc_rect region, const uint8_t *expected, int w) {
+    const int rw = region.x1 - region.x0, rh = region.y1 - region.y0;
+    const sc_point origin = { region.x0, region.y0 };
+    sc_animation anim;
+    sc_animation_init(&anim, rw, rh, &origin, 1);
+    uint8_t *pixels = (uint8_t *)malloc((size_t)rw * (size_t)rh * 4);
+    bool ok = pixels && sc_extract_frames(ctx, sheet, &anim, pixels) == SC_OK;
+    for (int y = 0; ok && y < rh; ++y) {
+        ok = memcmp(pixels + (size_t)y * rw * 4, expected + ((size_t)(region.y0 + y) * w + region.x0) * 4, (size_t)rw * 4) == 0;
+    }
+    free(pixels);
+    return ok;
+}
+
+static void check_png_regions(sc_context *ctx) {
+    static const PngCase cases[] = {
+        { "gray, filter 0", 0, false, 0, false, 0 },
+        { "gray, filter 1", 0, false, 1, true, 0 },
+        { "gray, filter 2", 0, false, 2, false, 0 },
+        { "gray, filter 3", 0, false, 3, true, 0 },
+        { "gray, filter 4", 0, false, 4, false, 0 },
+        { "gray + tRNS, mixed filters", 0, true, -1, true, 0 },
+        { "RGB, filter 0", 2, false, 0, true, 0 },
+        { "RGB, filter 1", 2, false, 1, false, 0 },
+        { "RGB, filter 2", 2, false, 2, true, 0 },
+        { "RGB, filter 3", 2, false, 3, false, 0 },
+        { "RGB, filter 4", 2, false, 4, true, 0 },
+        { "RGB + tRNS, mixed filters", 2, true, -1, false, 0 },
+        { "palette, filter 4", 3, false, 4, true, 0 },
+        { "palette + tRNS, mixed filters", 3, true, -1, false, 0 },
+        { "palette + tRNS, split IDAT", 3, true, -1, true, 4096 },
+        { "RGB, mixed filters, split IDAT", 2, false, -1, false, 1000 },
+        { "gray + tRNS, split IDAT", 0, true, 2, true, 777 },
+    };
+    // Regions at the top, in the middle and at the bottom right of a 300 x 400 image, whose
+    // rows below the first two are well past what the decoder needs for them.
+    static const sc_rect regions[] = {
+        { 0, 0, 300, 8 },
+        { 37, 21, 151, 90 },
+        { 250, 330, 300, 400 },
+    };
+    const int w = 300, h = 400;
+    char what[128];
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        Buffer png = write_png(&cases[i], w, h);
+        int sw = 0, sh = 0, n = 0;
+        uint8_t *expected = stbi_load_from_memory(png.data, (int)png.size, &sw, &sh, &n, 4);
+        snprintf(what, sizeof(what), "stbi_load decodes the %s PNG", cases[i].name);
+        check(expected && sw == w && sh == h, what);
+        for (size_t r = 0; expected && r < sizeof(regions) / sizeof(regions[0]); ++r) {
+            sc_sheet *sheet = NULL;
+            const sc_status status = sc_sheet_load_memory(ctx, png.data, png.size, &regions[r], &sheet);
+            snprintf(what, sizeof(what), "%s PNG, region %zu: matches stbi_load", cases[i].name, r);
+            check(status == SC_OK && region_matches(ctx, sheet, regions[r], expected, w), what);
+            // a sheet decoded whole holds w * h samples on top of the PNG itself
+            snprintf(what, sizeof(what), "%s PNG, region %zu: decoded as a region", cases[i].name, r);
+            check(status == SC_OK && sc_sheet_memory(sheet) < png.size + (size_t)w * h * png_channels(cases[i].color_type), what);
+            sc_sheet_free(sheet);
+        }
+        stbi_image_free(expected);
+        free(png.data);
+    }
+}
+
+// The palette sheet the GIF checks cut from: 24 x 24 frames in a grid.
+static const PngCase gif_sheet = { "GIF sheet", 3, false, -1, false, 0 };
+
+static sc_point gif_points[24];
+
+static void init_gif_animation(sc_animation *anim, bool delta, bool keep_palette) {
+    for (int i = 0; i < 24; ++i) {
+        gif_points[i].x = (i % 8) * 24;
+        gif_points[i].y = (i / 8) * 24 + (i % 3);
+    }
+    sc_animation_init(anim, 24, 24, gif_points, 24);
+    anim->output_w = 48;
+    anim->output_h = 36;
+    anim->delta = delta;
+    anim->keep_palette = keep_palette;
+}
+
+static bool encode(sc_context *ctx, const sc_sheet *sheet, const sc_animation *anim, uint8_t **gif, size_t *size) {
+    return sc_encode_gif_to_buffer(ctx, sheet, anim, gif, size, NULL) == SC_OK;
+}
+
+static bool same_bytes(const uint8_t *a, size_t a_size, const uint8_t *b, size_t b_size) {
+    return a && b && a_size == b_size && memcmp(a, b, a_size) == 0;
+}
+
+static void check_gifs(const Buffer *png, const char *dir) {
+    static const struct {
+        bool delta;
+        bool keep_palette;
+        bool global_palette;
+    } variants[] = {
+        { false, false, false },
+        { true, false, false },
+        { false, false, true },
+        { true, true, false },
+    };
+    char path[512], cache[512], what[128];
+    snprintf(path, sizeof(path), "%s/sheet.png", dir);
+    snprintf(cache, sizeof(cache), "%s/cache", dir);
+    FILE *file = fopen(path, "wb");
+    check(file && fwrite(png->data, 1, png->size, file) == png->size && fclose(file) == 0, "writing the GIF sheet");
+
+    sc_context *one = sc_context_create(1);
+    sc_context *many = sc_context_create(4);
+    sc_context *cold = sc_context_create(4);
+    sc_context *warm = sc_context_create(1);
+    check(one && many && cold && warm, "creating contexts");
+    if (!one || !many || !cold || !warm) {
+        return;
+    }
+    check(sc_context_set_cache(cold, cache) == SC_OK && sc_context_set_cache(warm, cache) == SC_OK, "setting the cache");
+    sc_sheet *sheet = NULL, *cold_sheet = NULL, *warm_sheet = NULL;
+    check(sc_sheet_load(one, path, NULL, &sheet) == SC_OK, "loading the GIF sheet");
+    check(sc_sheet_load(cold, path, NULL, &cold_sheet) == SC_OK, "loading the GIF sheet into the cache");
+    check(sc_sheet_load(warm, path, NULL, &warm_sheet) == SC_OK, "loading the GIF sheet from the cache");
+
+    for (size_t v = 0; sheet && cold_sheet && warm_sheet && v < sizeof(variants) / sizeof(variants[0]); ++v) {
+        sc_animation anim;
+        init_gif_animation(&anim, variants[v].delta, variants[v].keep_palette);
+        anim.global_palette = variants[v].global_palette;
+        uint8_t *a = NULL, *b = NULL, *c = NULL, *d = NULL;
+        size_t a_size = 0, b_size = 0, c_size = 0, d_size = 0;
+        encode(one, sheet, &anim, &a, &a_size);
+        encode(many, sheet, &anim, &b, &b_size);
+        encode(cold, cold_sheet, &anim, &c, &c_size);
+        encode(warm, warm_sheet, &anim, &d, &d_size);
+        snprintf(what, sizeof(what), "GIF variant %zu: 1 and 4 threads give the same bytes", v);
+        check(same_bytes(a, a_size, b, b_size), what);
+        snprintf(what, sizeof(what), "GIF variant %zu: a cold cache gives the same bytes", v);
+        check(same_bytes(a, a_size, c, c_size), what);
+        snprintf(what, sizeof(what), "GIF variant %zu: a warm cache gives the same bytes", v);
+        check(same_bytes(a, a_size, d, d_size), what);
+        sc_free(a);
+        sc_free(b);
+        sc_free(c);
+        sc_free(d);
+    }
+
+    // With the sheet's own palette nothing is quantized, so stb_image must get back exactly
+    // the frames that were cut, delta frames included.
+    sc_animation anim;
+    init_gif_animation(&anim, true, true);
+    uint8_t *gif = NULL;
+    size_t gif_size = 0;
+    sc_encode_info info;
+    const size_t frame_size = (size_t)anim.output_w * anim.output_h * 4;
+    uint8_t *frames = (uint8_t *)malloc(frame_size * anim.frame_count);
+    check(sheet && sc_encode_gif_to_buffer(one, sheet, &anim, &gif, &gif_size, &info) == SC_OK && info.palette_kept, "encoding with the sheet's palette");
+    check(frames && sheet && sc_extract_frames(one, sheet, &anim, frames) == SC_OK, "extracting frames");
+    int *delays = NULL, w = 0, h = 0, z = 0, n = 0;
+    uint8_t *decoded = gif && frames ? stbi_load_gif_from_memory(gif, (int)gif_size, &delays, &w, &h, &z, &n, 4) : NULL;
+    check(decoded && w == anim.output_w && h == anim.output_h && z == anim.frame_count, "stb_image decodes the GIF");
+    check(decoded && z == anim.frame_count && memcmp(decoded, frames, frame_size * anim.frame_count) == 0, "the GIF decodes to the extracted frames");
+    check(delays && z > 0 && delays[0] == (int)anim.delay_cs * 10, "the GIF keeps its frame delay");
+    stbi_image_free(decoded);
+    stbi_image_free(delays);
+    free(frames);
+    sc_free(gif);
+
+    sc_sheet_free(sheet);
+    sc_sheet_free(cold_sheet);
+    sc_sheet_free(warm_sheet);
+    sc_context_destroy(one);
+    sc_context_destroy(many);
+    sc_context_destroy(cold);
+    sc_context_destroy(warm);
+}
+
+int main(int argc, char **argv) {
+    Buffer sheet = write_png(&gif_sheet, 192, 80);
+    if (argc == 3 && strcmp(argv[1], "--write-sheet") == 0) {
+        FILE *file = fopen(argv[2], "wb");
+        const bool ok = file && fwrite(sheet.data, 1, sheet.size, file) == sheet.size && fclose(file) == 0;
+        free(sheet.data);
+        return ok ? 0 : 1;
+    }
+
+    sc_context *ctx = sc_context_create(1);
+    if (!ctx) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    check_png_regions(ctx);
+    sc_context_destroy(ctx);
+
+    char dir[] = "/tmp/spritechop-check-XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    check_gifs(&sheet, dir);
+    free(sheet.data);
+    char command[64];
+    snprintf(command, sizeof(command), "rm -rf '%s'", dir);
+    if (system(command) != 0) {
+        fprintf(stderr, "could not remove %s\n", dir);
+    }
+
+    if (failures) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("libspritechop: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,46 @@
+#!/bin/sh
+# check.sh - runs tests/check, then checks that the spritechop command writes the same GIFs
+# with one or several threads and with a cold or warm --cache. Run by `make check`.
+
+set -eu
+
+BIN=${1:-./spritechop}
+CHECK=${2:-tests/check}
+
+"$CHECK"
+
+dir=$(mktemp -d "${TMPDIR:-/tmp}/spritechop-check-XXXXXX")
+trap 'rm -rf "$dir"' EXIT
+
+"$CHECK" --write-sheet "$dir/sheet.png"
+frames="0,0 24,0 48,0 72,0 96,0 120,0 144,0 168,0 0,25 24,25 48,25 72,25 96,26 120,26 144,26 168,26"
+failed=0
+
+# Runs spritechop on the sheet with the given options, writing to $dir/$1.gif.
+cut() {
+    name=$1
+    shift
+    "$BIN" -i "$dir/sheet.png" -o "$dir/$name.gif" -s 24x24 -so 48x36 "$@" $frames >/dev/null
+}
+
+same() {
+    if ! cmp -s "$dir/$1.gif" "$dir/$2.gif"; then
+        echo "FAIL: $3" >&2
+        failed=1
+    fi
+}
+
+for options in "" "--delta" "--global-palette" "--delta --keep-palette"; do
+    cut j1 -j 1 $options
+    cut j4 -j 4 $options
+    cut cold -j 4 --cache "$dir/cache" $options
+    cut warm -j 1 --cache "$dir/cache" $options
+    same j1 j4 "-j 1 and -j 4 write the same GIF (options: $options)"
+    same j1 cold "a cold --cache writes the same GIF (options: $options)"
+    same j1 warm "a warm --cache writes the same GIF (options: $options)"
+done
+
+if [ "$failed" -ne 0 ]; then
+    exit 1
+fi
+echo "spritechop: all checks passed"